@@ -0,0 +1,77 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Bump allocator: memory is handed out from large blocks and only released
+// all at once when the arena is destroyed.
+struct Arena {
+  static constexpr size_t MIN_BLOCK_SIZE = 64 * 1024;
+  static constexpr size_t MAX_BLOCK_SIZE = 16 * 1024 * 1024;
+
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  Arena(Arena &&other) { *this = std::move(other); }
+  Arena &operator=(Arena &&other) {
+    blocks = std::move(other.blocks);
+    ptr = std::exchange(other.ptr, nullptr);
+    end = std::exchange(other.end, nullptr);
+    nextBlockSize = std::exchange(other.nextBlockSize, MIN_BLOCK_SIZE / 2);
+    used = std::exchange(other.used, 0);
+    reserved = std::exchange(other.reserved, 0);
+    return *this;
+  }
+
+  void *allocate(size_t size, size_t align) {
+    size_t offset = (align - reinterpret_cast<uintptr_t>(ptr) % align) % align;
+    if (!ptr || offset + size > static_cast<size_t>(end - ptr)) {
+      newBlock(size + align);
+      offset = (align - reinterpret_cast<uintptr_t>(ptr) % align) % align;
+    }
+    char *result = ptr + offset;
+    ptr = result + size;
+    used += size;
+    return result;
+  }
+
+  template <class T> T *allocate(size_t count) {
+    if (count == 0)
+      return nullptr;
+    return static_cast<T *>(allocate(sizeof(T) * count, alignof(T)));
+  }
+
+  // Copies `count` objects into the arena. T must be trivially copyable.
+  template <class T> const T *copy(const T *src, size_t count) {
+    T *dst = allocate<T>(count);
+    if (count)
+      std::memcpy(dst, src, sizeof(T) * count);
+    return dst;
+  }
+
+  std::string_view copy(std::string_view str) {
+    return {copy(str.data(), str.size()), str.size()};
+  }
+
+  void newBlock(size_t minSize) {
+    nextBlockSize = std::min(nextBlockSize * 2, MAX_BLOCK_SIZE);
+    size_t size = std::max(nextBlockSize, minSize);
+    blocks.emplace_back(new char[size]);
+    ptr = blocks.back().get();
+    end = ptr + size;
+    reserved += size;
+  }
+
+  std::vector<std::unique_ptr<char[]>> blocks;
+  char *ptr = nullptr;
+  char *end = nullptr;
+  size_t nextBlockSize = MIN_BLOCK_SIZE / 2;
+  // Bytes handed out and bytes obtained from the system
+  size_t used = 0;
+  size_t reserved = 0;
+};
@@ -0,0 +1,292 @@
+// Throughput and heap allocations per document of each stage (tokenise, parse,
+// evaluate, serialise) over synthetic documents of different shapes:
+//   bench [--benchmark_filter=Parse/logs]
+// and time per evaluation of typical expressions (EvalExpr/...).
+// MB/s is of the input document for every stage. Documents are 4 MB unless
+// JSON_EVAL_BENCH_MB says otherwise; for ndjson each line is a document.
+#include <atomic>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "benchGenerators.h"
+#include "document.h"
+#include "eval.h"
+#include "parallelParser.h"
+
+// Every heap allocation in the process, for the allocs/doc counters
+static std::atomic<size_t> allocations{0};
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+struct Shape {
+  const char *name;
+  std::string (*generate)(size_t bytes);
+  // What the evaluate benchmarks compute
+  const char *expr;
+  bool lines;
+};
+
+const Shape shapes[] = {
+    {"deep", [](size_t bytes) { return generateDeep(bytes); },
+     "size([1].d[0].d[0].d[0])", false},
+    {"wide", generateWide, "k1001", false},
+    {"numbers", generateNumbers, "max(values)", false},
+    {"series", generateSeries, "max(values)", false},
+    {"logs", generateLogs, "[7].message", false},
+    {"ndjson", generateNdjson, "max(pos.x, id, pos.y[2])", true},
+};
+
+struct BenchInput {
+  std::string text;
+  std::vector<std::string_view> docs;
+};
+
+// Generated on first use, so filtered runs only build what they need
+inline const BenchInput &benchInput(int shape) {
+  static std::unique_ptr<BenchInput> cache[std::size(shapes)];
+  if (!cache[shape]) {
+    size_t megabytes = 4;
+    if (const char *env = std::getenv("JSON_EVAL_BENCH_MB"))
+      megabytes = std::atoi(env);
+    auto input = std::make_unique<BenchInput>();
+    input->text = shapes[shape].generate(megabytes * 1024 * 1024);
+    std::string_view text = input->text;
+    if (!shapes[shape].lines) {
+      input->docs.push_back(text);
+    } else {
+      for (size_t pos = 0; pos < text.size();) {
+        size_t end = text.find('\n', pos);
+        input->docs.push_back(text.substr(pos, end - pos));
+        pos = end + 1;
+      }
+    }
+    cache[shape] = std::move(input);
+  }
+  return *cache[shape];
+}
+
+// Counts allocations made between construction and `report`
+struct AllocCounter {
+  void report(benchmark::State &state, const BenchInput &input) {
+    double docs = double(state.iterations()) * input.docs.size();
+    state.SetBytesProcessed(state.iterations() * input.text.size());
+    state.SetItemsProcessed(docs);
+    state.counters["allocs/doc"] = (allocations - start) / docs;
+  }
+
+  size_t start = allocations;
+};
+
+inline void benchTokenise(benchmark::State &state, int shape) {
+  const BenchInput &input = benchInput(shape);
+  JsonTokeniser tokeniser;
+  AllocCounter counter;
+  for (auto _ : state) {
+    for (std::string_view doc : input.docs) {
+      tokeniser.reset(doc);
+      size_t tokens = 0;
+      while (tokeniser.next().type != JsonTokenType::EOF_)
+        tokens++;
+      benchmark::DoNotOptimize(tokens);
+    }
+  }
+  counter.report(state, input);
+}
+
+inline void benchParse(benchmark::State &state, int shape) {
+  const BenchInput &input = benchInput(shape);
+  JsonParser parser;
+  // As `--lines` does
+  parser.reuseKeys = shapes[shape].lines;
+  AllocCounter counter;
+  for (auto _ : state) {
+    for (std::string_view doc : input.docs)
+      benchmark::DoNotOptimize(parser.parse(doc));
+  }
+  counter.report(state, input);
+}
+
+// On every core, with the document split into runs of 1 MB
+inline void benchParseParallel(benchmark::State &state, int shape) {
+  const BenchInput &input = benchInput(shape);
+  ThreadPool pool;
+  ParallelParser parser(pool);
+  AllocCounter counter;
+  for (auto _ : state) {
+    for (std::string_view doc : input.docs)
+      benchmark::DoNotOptimize(parser.parse(doc));
+  }
+  counter.report(state, input);
+}
+
+inline void benchParseDocument(benchmark::State &state, int shape) {
+  const BenchInput &input = benchInput(shape);
+  DocumentParser parser;
+  AllocCounter counter;
+  for (auto _ : state) {
+    for (std::string_view doc : input.docs)
+      benchmark::DoNotOptimize(parser.parseView(doc).root);
+  }
+  counter.report(state, input);
+}
+
+inline void benchEvaluate(benchmark::State &state, int shape) {
+  const BenchInput &input = benchInput(shape);
+  JsonParser parser;
+  parser.reuseKeys = shapes[shape].lines;
+  std::vector<Json> docs;
+  for (std::string_view doc : input.docs)
+    docs.push_back(parser.parse(doc));
+  CompiledExpr expr = compileExpr(shapes[shape].expr);
+  AllocCounter counter;
+  for (auto _ : state) {
+    for (const Json &doc : docs)
+      benchmark::DoNotOptimize(expr.eval(doc));
+  }
+  counter.report(state, input);
+}
+
+inline void benchEvaluateDocument(benchmark::State &state, int shape) {
+  const BenchInput &input = benchInput(shape);
+  DocumentParser parser;
+  std::vector<Document> docs;
+  for (std::string_view doc : input.docs)
+    docs.push_back(parser.parseView(doc));
+  CompiledExpr expr = compileExpr(shapes[shape].expr);
+  AllocCounter counter;
+  for (auto _ : state) {
+    for (const Document &doc : docs)
+      benchmark::DoNotOptimize(expr.eval(doc));
+  }
+  counter.report(state, input);
+}
+
+inline void benchSerialise(benchmark::State &state, int shape) {
+  const BenchInput &input = benchInput(shape);
+  JsonParser parser;
+  std::vector<Json> docs;
+  for (std::string_view doc : input.docs)
+    docs.push_back(parser.parse(doc));
+  // Reused, as when writing many results
+  std::string out;
+  AllocCounter counter;
+  for (auto _ : state) {
+    for (const Json &doc : docs) {
+      out.clear();
+      JsonWriter writer(out);
+      doc->write(writer);
+      benchmark::DoNotOptimize(out.data());
+    }
+  }
+  counter.report(state, input);
+}
+
+// MB/s here is of expression text
+inline void benchCompileExpr(benchmark::State &state) {
+  std::vector<std::string> exprs = {"a.b[0]", "a.b[a.b[1]].c",
+                                    "max(a.b[0], 10, a.b[1], 15)",
+                                    "size(a.b[3]) ", "min(x.y.z[2], 1.5)"};
+  size_t bytes = 0;
+  for (auto &expr : exprs)
+    bytes += expr.size();
+  ExprParser parser;
+  size_t start = allocations;
+  for (auto _ : state) {
+    for (auto &expr : exprs)
+      benchmark::DoNotOptimize(parser.compile(expr).root);
+  }
+  double compiled = double(state.iterations()) * exprs.size();
+  state.SetBytesProcessed(state.iterations() * bytes);
+  state.SetItemsProcessed(compiled);
+  state.counters["allocs/expr"] = (allocations - start) / compiled;
+}
+
+// Time per evaluation of typical expressions against a small document, by
+// the bytecode `ExprProgram` or by walking the expression DAG
+const char *const typicalExprs[] = {
+    "a.b[1]", "a.b[2].c", "a.b[a.b[0]]", "size(a.b)",
+    "max(a.b[0], a.b[1], 1.5)", "min(a.b[3])", "a.x ?? 0",
+};
+
+inline void benchEvalExpr(benchmark::State &state, const char *input,
+                          bool bytecode) {
+  Json doc = JsonParser().parse(
+      R"({"a": {"b": [1, 2, {"c": "test"}, [11, 12]]}, "x": true})");
+  CompiledExpr expr = compileExpr(input);
+  // Without a program, `eval` walks the DAG as it did before
+  if (!bytecode)
+    expr.program = ExprProgram();
+  size_t start = allocations;
+  for (auto _ : state)
+    benchmark::DoNotOptimize(expr.eval(doc));
+  state.counters["allocs/eval"] =
+      (allocations - start) / double(state.iterations());
+}
+
+// A missing field given a default the way it was before `??`, for comparison
+// with EvalExpr/.../a.x ?? 0
+inline void benchEvalMissingCaught(benchmark::State &state) {
+  Json doc = JsonParser().parse(
+      R"({"a": {"b": [1, 2, {"c": "test"}, [11, 12]]}, "x": true})");
+  CompiledExpr expr = compileExpr("a.x");
+  Json fallback = JsonParser().parse("0");
+  for (auto _ : state) {
+    Json result;
+    try {
+      result = expr.eval(doc);
+    } catch (const InvalidOperation &) {
+      result = fallback;
+    }
+    benchmark::DoNotOptimize(result);
+  }
+}
+
+int main(int argc, char **argv) {
+  using Bench = void (*)(benchmark::State &, int);
+  std::pair<const char *, Bench> stages[] = {
+      {"Tokenise", benchTokenise},
+      {"Parse", benchParse},
+      {"ParseParallel", benchParseParallel},
+      {"ParseDocument", benchParseDocument},
+      {"Evaluate", benchEvaluate},
+      {"EvaluateDocument", benchEvaluateDocument},
+      {"Serialise", benchSerialise},
+  };
+  for (auto [stage, bench] : stages) {
+    for (size_t shape = 0; shape < std::size(shapes); shape++) {
+      std::string name = std::string(stage) + "/" + shapes[shape].name;
+      benchmark::RegisterBenchmark(name.c_str(), bench, shape)
+          ->Unit(benchmark::kMillisecond);
+    }
+  }
+  benchmark::RegisterBenchmark("CompileExpr", benchCompileExpr);
+  for (const char *input : typicalExprs) {
+    for (bool bytecode : {true, false}) {
+      std::string name = std::string("EvalExpr/") +
+                         (bytecode ? "bytecode/" : "tree/") + input;
+      benchmark::RegisterBenchmark(name.c_str(), benchEvalExpr, input,
+                                   bytecode);
+    }
+  }
+  benchmark::RegisterBenchmark("EvalExpr/caught/a.x", benchEvalMissingCaught);
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+}
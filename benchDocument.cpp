@@ -0,0 +1,87 @@
+// Compares parse time, teardown time and peak memory of the shared_ptr
+// JsonValue tree against the arena-allocated Document.
+//
+// Peak RSS is a per-process high-water mark, so each representation is
+// measured in its own run:
+//   bench_document tree [megabytes]
+//   bench_document document [megabytes]
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+
+#include <psapi.h>
+#pragma comment(lib, "psapi")
+#else
+#include <sys/resource.h>
+#endif
+
+#include "benchGenerators.h"
+#include "document.h"
+#include "jsonParser.h"
+
+inline size_t peakRssKb() {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+  return counters.PeakWorkingSetSize / 1024;
+#else
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+#endif
+}
+
+template <class F> inline double timeMs(F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " [tree|document] [megabytes]"
+              << std::endl;
+    return 0;
+  }
+  std::string mode = argv[1];
+  size_t megabytes = argc > 2 ? std::atoi(argv[2]) : 64;
+
+  std::string input = generateRecords(megabytes * 1024 * 1024);
+  size_t baseRss = peakRssKb();
+  double parseMs, freeMs;
+
+  if (mode == "tree") {
+    JsonParser parser;
+    Json *root = new Json;
+    parseMs = timeMs([&] { *root = parser.parse(input); });
+    parser = JsonParser();
+    freeMs = timeMs([&] { delete root; });
+  } else if (mode == "document") {
+    DocumentParser parser;
+    Document *doc = new Document;
+    parseMs = timeMs([&] { *doc = parser.parse(input); });
+    std::cout << "arena bytes: " << doc->arena.reserved << std::endl;
+    parser = DocumentParser();
+    freeMs = timeMs([&] { delete doc; });
+  } else {
+    std::cout << "Unknown mode: " << mode << std::endl;
+    return 1;
+  }
+
+  double mb = input.size() / (1024.0 * 1024.0);
+  std::cout << "input: " << mb << " MB" << std::endl;
+  std::cout << "parse: " << parseMs << " ms (" << mb / (parseMs / 1000)
+            << " MB/s)" << std::endl;
+  std::cout << "free: " << freeMs << " ms" << std::endl;
+  std::cout << "peak RSS above input: " << (peakRssKb() - baseRss) / 1024
+            << " MB" << std::endl;
+}
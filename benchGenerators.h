@@ -0,0 +1,110 @@
+#pragma once
+#include <string>
+
+// Synthetic documents of representative shapes for the benchmarks, each
+// roughly `bytes` long.
+
+// An array of small records
+inline std::string generateRecords(size_t bytes) {
+  std::string out = "[";
+  for (int i = 0; out.size() < bytes; i++) {
+    if (i)
+      out += ",\n";
+    std::string id = std::to_string(i);
+    out += "{\"id\": " + id + ", \"name\": \"user" + id +
+           "\", \"score\": " + std::to_string(i % 100) +
+           ".5, \"active\": true, \"tags\": [\"a\", \"b\", null], "
+           "\"pos\": {\"x\": " +
+           id + ", \"y\": [1, 2, 3]}}";
+  }
+  out += "]";
+  return out;
+}
+
+// An array of objects and arrays nested `depth` levels deep
+inline std::string generateDeep(size_t bytes, int depth = 256) {
+  std::string out = "[";
+  for (int i = 0; out.size() < bytes; i++) {
+    if (i)
+      out += ",\n";
+    for (int d = 0; d < depth; d++)
+      out += d % 2 ? "[" : "{\"d\": ";
+    out += std::to_string(i);
+    for (int d = depth - 1; d >= 0; d--)
+      out += d % 2 ? "]" : "}";
+  }
+  out += "]";
+  return out;
+}
+
+// One object with a key per value: {"k0": 0, "k1": "1", ...}
+inline std::string generateWide(size_t bytes) {
+  std::string out = "{";
+  for (int i = 0; out.size() < bytes; i++) {
+    if (i)
+      out += ", ";
+    std::string id = std::to_string(i);
+    out += "\"k" + id + "\": " + (i % 2 ? "\"" + id + "\"" : id);
+  }
+  out += "}";
+  return out;
+}
+
+// {"values": [...]} with integers and doubles mixed
+inline std::string generateNumbers(size_t bytes) {
+  std::string out = "{\"values\": [";
+  for (int i = 0; out.size() < bytes; i++) {
+    if (i)
+      out += ", ";
+    int val = (i * 7919) % 100003 - 50000;
+    out += i % 3 ? std::to_string(val) : std::to_string(val) + ".25";
+  }
+  out += "]}";
+  return out;
+}
+
+// A time series: {"ts": [integers], "values": [doubles]}, about half each
+inline std::string generateSeries(size_t bytes) {
+  std::string ts = "{\"ts\": [", values = "], \"values\": [";
+  for (int i = 0; ts.size() + values.size() < bytes; i++) {
+    if (i) {
+      ts += ", ";
+      values += ", ";
+    }
+    ts += std::to_string(1700000000000 + i * 1000ll);
+    values += std::to_string((i * 7919) % 100003 - 50000) + ".75";
+  }
+  return ts + values + "]}";
+}
+
+// An array of log entries whose messages are long and contain escapes
+inline std::string generateLogs(size_t bytes) {
+  std::string out = "[";
+  for (int i = 0; out.size() < bytes; i++) {
+    if (i)
+      out += ",\n";
+    std::string id = std::to_string(i);
+    out += "{\"ts\": \"2024-01-01T00:00:" + std::to_string(i % 60) +
+           "Z\", \"level\": \"" + (i % 10 ? "info" : "error") +
+           "\", \"message\": \"request " + id +
+           " handled by worker in the \\\"default\\\" pool after waiting on "
+           "the upstream connection; path=/api/v1/items/" +
+           id + "\\tstatus=200\\n\", \"tags\": [\"http\", \"api\"]}";
+  }
+  out += "]";
+  return out;
+}
+
+// Records as in `generateRecords`, one per line
+inline std::string generateNdjson(size_t bytes) {
+  std::string out;
+  for (int i = 0; out.size() < bytes; i++) {
+    std::string id = std::to_string(i);
+    out += "{\"id\": " + id + ", \"name\": \"user" + id +
+           "\", \"score\": " + std::to_string(i % 100) +
+           ".5, \"active\": true, \"tags\": [\"a\", \"b\", null], "
+           "\"pos\": {\"x\": " +
+           id + ", \"y\": [1, 2, 3]}}\n";
+  }
+  return out;
+}
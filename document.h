@@ -0,0 +1,422 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+#include "json.h"
+#include "jsonTokeniser.h"
+#include "jsonWriter.h"
+#include "stats.h"
+
+enum class JsonNodeType : uint8_t {
+  NULL_,
+  BOOL,
+  INT,
+  NUMBER,
+  STRING,
+  ARRAY,
+  OBJECT,
+};
+
+struct JsonMember;
+
+// A JSON value stored as plain data. Strings, elements and members live in the
+// arena of the `Document` which owns them, so a node must not outlive it.
+struct JsonNode {
+  inline static JsonNode makeBool(bool val) {
+    JsonNode node(JsonNodeType::BOOL);
+    node.boolean = val;
+    return node;
+  }
+  inline static JsonNode makeInt(int64_t val) {
+    JsonNode node(JsonNodeType::INT);
+    node.integer = val;
+    return node;
+  }
+  inline static JsonNode makeNumber(double val) {
+    JsonNode node(JsonNodeType::NUMBER);
+    node.number = val;
+    return node;
+  }
+  inline static JsonNode makeString(std::string_view val) {
+    JsonNode node(JsonNodeType::STRING);
+    node.len = checkLength(val.size(), "String");
+    node.str = val.data();
+    return node;
+  }
+  inline static JsonNode makeArray(const JsonNode *elems, size_t len) {
+    JsonNode node(JsonNodeType::ARRAY);
+    node.len = checkLength(len, "Array");
+    node.elems = elems;
+    return node;
+  }
+  inline static JsonNode makeObject(const JsonMember *members, size_t len) {
+    JsonNode node(JsonNodeType::OBJECT);
+    node.len = checkLength(len, "Object");
+    node.members = members;
+    return node;
+  }
+
+  // Lengths are stored in 32 bits to keep nodes at 16 bytes
+  inline static uint32_t checkLength(size_t len, const char *what) {
+    if (len > UINT32_MAX) {
+      throw JsonParseError(std::string(what) +
+                           " too long: " + std::to_string(len));
+    }
+    return len;
+  }
+
+  inline JsonNode(JsonNodeType type = JsonNodeType::NULL_)
+      : type(type), integer(0) {}
+
+  inline std::string toString() const {
+    std::string out;
+    write(out);
+    return out;
+  }
+  inline void write(std::string &out) const;
+  inline void write(JsonWriter &out) const;
+
+  inline std::string_view getString() const {
+    if (type != JsonNodeType::STRING)
+      throw InvalidOperation("Cannot treat " + typeName() + " as string");
+    return {str, len};
+  }
+  inline double getNumber() const {
+    if (type == JsonNodeType::INT)
+      return integer;
+    if (type != JsonNodeType::NUMBER)
+      throw InvalidOperation("Cannot treat " + typeName() + " as number");
+    return number;
+  }
+  inline int64_t getInt() const {
+    if (type != JsonNodeType::INT)
+      throw InvalidOperation("Cannot treat " + typeName() + " as int");
+    return integer;
+  }
+  inline const JsonNode &getIndex(int64_t index) const {
+    if (type == JsonNodeType::OBJECT)
+      throw InvalidOperation("Cannot index object by int");
+    if (type != JsonNodeType::ARRAY)
+      throw InvalidOperation("Cannot index " + typeName());
+    if (index < 0 || index >= len) {
+      throw InvalidOperation("Invalid index to array: " +
+                             std::to_string(index));
+    }
+    return elems[index];
+  }
+  // As `getIndex`, but nullptr instead of throwing if there is no such
+  // element, or this is not an array
+  inline const JsonNode *findIndex(int64_t index) const {
+    if (type != JsonNodeType::ARRAY || index < 0 || index >= len)
+      return nullptr;
+    return &elems[index];
+  }
+  inline const JsonNode &getKey(std::string_view key) const;
+  inline const JsonNode *findKey(std::string_view key) const;
+  inline int size() const {
+    switch (type) {
+    case JsonNodeType::STRING:
+    case JsonNodeType::ARRAY:
+    case JsonNodeType::OBJECT:
+      return len;
+    default:
+      throw InvalidOperation("Cannot take size of " + typeName());
+    }
+  }
+  inline const JsonNode &min() const { return minMax(true); }
+  inline const JsonNode &max() const { return minMax(false); }
+
+  inline const JsonNode &minMax(bool isMin) const {
+    if (type != JsonNodeType::ARRAY)
+      throw InvalidOperation("Can only take min/max of array");
+    if (len == 0)
+      throw InvalidOperation(isMin ? "Min called on empty array"
+                                   : "Max called on empty array");
+    size_t index = 0;
+    double best = elems[0].getNumber();
+    for (size_t i = 1; i < len; i++) {
+      double v = elems[i].getNumber();
+      if (isMin ? v < best : v > best) {
+        best = v;
+        index = i;
+      }
+    }
+    return elems[index];
+  }
+
+  inline std::string typeName() const {
+    switch (type) {
+    case JsonNodeType::NULL_:
+      return "null";
+    case JsonNodeType::BOOL:
+      return "bool";
+    case JsonNodeType::INT:
+      return "int";
+    case JsonNodeType::NUMBER:
+      return "number";
+    case JsonNodeType::STRING:
+      return "string";
+    case JsonNodeType::ARRAY:
+      return "array";
+    case JsonNodeType::OBJECT:
+      return "object";
+    }
+    throw; // Unreachable
+  }
+
+  JsonNodeType type;
+  // STRING: bytes, ARRAY: elements, OBJECT: members
+  uint32_t len = 0;
+  union {
+    bool boolean;
+    int64_t integer;
+    double number;
+    const char *str;
+    const JsonNode *elems;
+    const JsonMember *members;
+  };
+};
+
+struct JsonMember {
+  std::string_view key;
+  JsonNode val;
+};
+
+inline const JsonNode &JsonNode::getKey(std::string_view key) const {
+  if (type == JsonNodeType::ARRAY)
+    throw InvalidOperation("Cannot index array by key");
+  if (type != JsonNodeType::OBJECT)
+    throw InvalidOperation("Cannot index " + typeName());
+  if (const JsonNode *val = findKey(key))
+    return *val;
+  throw InvalidOperation("Key not in object: " + std::string(key));
+}
+
+inline const JsonNode *JsonNode::findKey(std::string_view key) const {
+  if (type != JsonNodeType::OBJECT)
+    return nullptr;
+  // Later duplicates win, as with JsonObject
+  for (size_t i = len; i-- > 0;) {
+    if (members[i].key == key)
+      return &members[i].val;
+  }
+  return nullptr;
+}
+
+inline void JsonNode::write(std::string &out) const {
+  JsonWriter writer(out);
+  write(writer);
+}
+
+inline void JsonNode::write(JsonWriter &out) const {
+  switch (type) {
+  case JsonNodeType::NULL_:
+    out.null();
+    break;
+  case JsonNodeType::BOOL:
+    out.boolean(boolean);
+    break;
+  case JsonNodeType::INT:
+    out.integer(integer);
+    break;
+  case JsonNodeType::NUMBER:
+    out.number(number);
+    break;
+  case JsonNodeType::STRING:
+    out.string({str, len});
+    break;
+  case JsonNodeType::ARRAY:
+    out.beginArray();
+    for (size_t i = 0; i < len; i++)
+      elems[i].write(out);
+    out.endArray();
+    break;
+  case JsonNodeType::OBJECT:
+    out.beginObject();
+    for (size_t i = 0; i < len; i++) {
+      out.key(members[i].key);
+      members[i].val.write(out);
+    }
+    out.endObject();
+    break;
+  }
+}
+
+// A parsed document whose nodes all live in one arena, so the whole tree is
+// freed at once when the document is destroyed.
+struct Document {
+  JsonNode root;
+  Arena arena;
+  // The input text, if the document owns it. Strings without escapes point
+  // straight into it instead of being copied.
+  std::unique_ptr<const std::string> buffer;
+};
+
+struct DocumentParser {
+  // Takes ownership of `input_`, so moving the text in avoids any copy
+  Document parse(std::string input_) {
+    auto buffer = std::make_unique<const std::string>(std::move(input_));
+    Document doc = parseView(*buffer);
+    doc.buffer = std::move(buffer);
+    return doc;
+  }
+
+  // Strings in the result point into `input_`, which must outlive it
+  Document parseView(std::string_view input_) {
+    input = input_;
+    tokeniser.reset(input);
+    advance();
+
+    Document doc;
+    arena = &doc.arena;
+    elemStack.clear();
+    memberStack.clear();
+    doc.root = parseHelper();
+    if (token.type != JsonTokenType::EOF_) {
+      throw JsonParseError("Unexpected token");
+    }
+    arena = nullptr;
+    counts.flush();
+    return doc;
+  }
+
+  JsonToken advance() {
+    JsonToken current = token;
+    token = tokeniser.next();
+    counts.token();
+    return current;
+  }
+
+  JsonNode parseHelper() {
+    auto [type, start, end] = advance();
+    counts.value(type);
+    switch (type) {
+    case JsonTokenType::TRUE:
+      return JsonNode::makeBool(true);
+
+    case JsonTokenType::FALSE:
+      return JsonNode::makeBool(false);
+
+    case JsonTokenType::NULL_:
+      return JsonNode(JsonNodeType::NULL_);
+
+    case JsonTokenType::INT: {
+      std::string_view text = input.substr(start, end - start + 1);
+      int64_t val;
+      if (decodeInt(text, val))
+        return JsonNode::makeInt(val);
+      return JsonNode::makeNumber(decodeDouble(text));
+    }
+
+    case JsonTokenType::NUMBER:
+      return JsonNode::makeNumber(
+          decodeDouble(input.substr(start, end - start + 1)));
+
+    case JsonTokenType::STRING:
+      return JsonNode::makeString(string(start, end));
+
+    case JsonTokenType::LEFT_SQUARE:
+      return parseArray();
+
+    case JsonTokenType::RIGHT_SQUARE:
+      throw JsonParseError("Unexpected closing list bracket");
+
+    case JsonTokenType::LEFT_CURLY:
+      return parseObject();
+
+    case JsonTokenType::RIGHT_CURLY:
+      throw JsonParseError("Unexpected closing object bracket");
+
+    case JsonTokenType::COMMA:
+      throw JsonParseError("Unexpected comma");
+
+    case JsonTokenType::COLON:
+      throw JsonParseError("Unexpected colon");
+
+    case JsonTokenType::EOF_:
+      throw JsonParseError("Unexpected end of file");
+    }
+    throw; // Unreachable
+  }
+
+  // Elements are collected on a shared stack and copied into the arena once
+  // the array is closed, so each array is one contiguous allocation.
+  JsonNode parseArray() {
+    size_t base = elemStack.size();
+    if (token.type == JsonTokenType::RIGHT_SQUARE) {
+      advance();
+      return JsonNode::makeArray(nullptr, 0);
+    }
+
+    // Trailing commas not allowed
+    while (true) {
+      JsonNode elem = parseHelper();
+      elemStack.push_back(elem);
+      auto type = advance().type;
+      if (type == JsonTokenType::RIGHT_SQUARE)
+        break;
+      if (type != JsonTokenType::COMMA)
+        throw JsonParseError("Comma expected between elements of array");
+    }
+    size_t len = elemStack.size() - base;
+    const JsonNode *elems = arena->copy(elemStack.data() + base, len);
+    elemStack.resize(base);
+    return JsonNode::makeArray(elems, len);
+  }
+
+  // Only strings containing escapes need decoding into the arena
+  std::string_view string(size_t start, size_t end) {
+    std::string_view raw = input.substr(start + 1, end - start - 1);
+    if (raw.find('\\') == std::string_view::npos)
+      return raw;
+    scratch.clear();
+    decodeString(raw, scratch);
+    return arena->copy(scratch);
+  }
+
+  JsonNode parseObject() {
+    size_t base = memberStack.size();
+    if (token.type == JsonTokenType::RIGHT_CURLY) {
+      advance();
+      return JsonNode::makeObject(nullptr, 0);
+    }
+
+    // Trailing commas not allowed
+    while (true) {
+      auto [keyType, start, end] = advance();
+      if (keyType != JsonTokenType::STRING)
+        throw JsonParseError("Expected string key");
+
+      std::string_view key = string(start, end);
+
+      if (advance().type != JsonTokenType::COLON)
+        throw JsonParseError("Colon expected after key in object");
+
+      JsonNode val = parseHelper();
+      memberStack.push_back({key, val});
+
+      auto type = advance().type;
+      if (type == JsonTokenType::RIGHT_CURLY)
+        break;
+      if (type != JsonTokenType::COMMA)
+        throw JsonParseError("Comma expected between elements of object");
+    }
+    size_t len = memberStack.size() - base;
+    const JsonMember *members = arena->copy(memberStack.data() + base, len);
+    memberStack.resize(base);
+    return JsonNode::makeObject(members, len);
+  }
+
+  std::string_view input;
+  JsonToken token;
+  JsonTokeniser tokeniser;
+  Arena *arena = nullptr;
+  std::string scratch;
+  std::vector<JsonNode> elemStack;
+  std::vector<JsonMember> memberStack;
+  ParseCounts counts;
+};
@@ -1,17 +1,58 @@
 #pragma once
+#include <string>
+#include <string_view>
+#include <vector>
 
+#include "expr.h"
 #include "exprParser.h"
 #include "json.h"
 #include "jsonParser.h"
+#include "projection.h"
 
-inline Json evaluate(const std::string &jsonInput, const std::string &exprInput) {
+inline CompiledExpr compileExpr(const std::string &exprInput) {
+  ExprParser exprParser;
+  return exprParser.compile(exprInput);
+}
+
+inline Json evaluate(std::string_view jsonInput, const std::string &exprInput) {
   JsonParser jsonParser;
   // std::cout << jsonInput << std::endl;
   // std::cout << "Parsing JSON..." << std::endl;
   Json parsedJson = jsonParser.parse(jsonInput);
-  ExprParser exprParser;
   // std::cout << exprInput << std::endl;
   // std::cout << "Parsing expr..." << std::endl;
-  Json result = exprParser.parse(parsedJson, exprInput);
-  return result;
+  return compileExpr(exprInput).eval(parsedJson);
+}
+
+// Only builds the parts of the JSON the expression reads. Malformed JSON in
+// the skipped parts is not reported.
+inline Json evaluateLazy(std::string_view jsonInput,
+                         const std::string &exprInput) {
+  CompiledExpr expr = compileExpr(exprInput);
+  JsonParser jsonParser;
+  Json parsedJson = jsonParser.parse(jsonInput, projectExpr(expr));
+  return expr.eval(parsedJson);
+}
+
+inline ExprBatch compileExprs(const std::vector<std::string> &exprInputs) {
+  ExprParser exprParser;
+  return exprParser.compileBatch(exprInputs);
+}
+
+// Parses the JSON once for all the expressions. Each result holds either the
+// value or why that expression failed.
+inline std::vector<BatchResult<Json>>
+evaluateAll(std::string_view jsonInput,
+            const std::vector<std::string> &exprInputs) {
+  JsonParser jsonParser;
+  Json parsedJson = jsonParser.parse(jsonInput);
+  return compileExprs(exprInputs).eval(parsedJson);
+}
+
+inline std::vector<BatchResult<Json>>
+evaluateAllLazy(std::string_view jsonInput,
+                const std::vector<std::string> &exprInputs) {
+  ExprBatch batch = compileExprs(exprInputs);
+  JsonParser jsonParser;
+  return batch.eval(jsonParser.parse(jsonInput, projectBatch(batch)));
 }
@@ -0,0 +1,933 @@
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "document.h"
+#include "json.h"
+#include "keyTable.h"
+
+enum class ExprNodeType {
+  GLOBAL,
+  LITERAL,
+  KEY,
+  INDEX,
+  MIN,
+  MAX,
+  SIZE,
+  // `base?.key` and `base?.[index]`: null where KEY or INDEX would throw for
+  // want of the member or element
+  OPT_KEY,
+  OPT_INDEX,
+  // `args[0] ?? args[1]`
+  COALESCE,
+};
+
+using Expr = std::shared_ptr<struct ExprNode>;
+
+struct ExprNode {
+  ExprNodeType type;
+  // KEY, INDEX, OPT_KEY, OPT_INDEX: the value being accessed
+  Expr base;
+  // INDEX, OPT_INDEX: the subscript. Otherwise the arguments
+  std::vector<Expr> args;
+  // KEY, OPT_KEY: the key being looked up, and its ID in the last document's
+  // keys
+  std::string key;
+  KeyCache keyCache;
+  // LITERAL: the value, built once at compile time
+  Json literal;
+  JsonNode literalNode;
+  // Identifies the subexpression, e.g. `.a.b[.a.b[1]]`. Equal subexpressions
+  // are compiled to one node, and `ExprCache` keeps results by it.
+  std::string text;
+  uint64_t hash = 0;
+  // Where the value is memoised during one evaluation, for nodes reached more
+  // than once. -1 if not shared.
+  int slot = -1;
+  // Only keys and literal subscripts from the document, so `PathIndex` can
+  // resolve it. Its depth is the number of steps.
+  bool literalPath = false;
+  int depth = 0;
+};
+
+inline void countUses(ExprNode *node,
+                      std::unordered_map<ExprNode *, int> &uses) {
+  // Children of a shared node are only reached through it
+  if (uses[node]++ > 0)
+    return;
+  if (node->base)
+    countUses(node->base.get(), uses);
+  for (auto &arg : node->args)
+    countUses(arg.get(), uses);
+}
+
+// Gives a memo slot to every node reachable from more than one place, other
+// than the document itself and literals, which cost nothing to evaluate.
+// Returns the number of slots.
+inline int assignSlots(const std::vector<ExprNode *> &roots) {
+  std::unordered_map<ExprNode *, int> uses;
+  for (ExprNode *root : roots)
+    countUses(root, uses);
+  int slots = 0;
+  for (auto &[node, count] : uses) {
+    bool cheap = node->type == ExprNodeType::GLOBAL ||
+                 node->type == ExprNodeType::LITERAL;
+    node->slot = !cheap && count > 1 ? slots++ : -1;
+  }
+  return slots;
+}
+
+// Results of subexpressions kept across evaluations against the same `Json`
+// document, such as many expressions answered from one document. They are
+// keyed by canonical text, so expressions compiled separately share them.
+// Not safe to share between threads.
+struct ExprCache {
+  // Starts over for another document. Holding on to the document keeps its
+  // address from being reused by the next one.
+  void use(const Json &doc) {
+    if (doc != document) {
+      results.clear();
+      document = doc;
+    }
+  }
+
+  const Json *find(const ExprNode &node) const {
+    auto it = results.find(TextKey{node.text, node.hash});
+    return it == results.end() ? nullptr : &it->second;
+  }
+
+  // Emptied when full
+  void insert(const ExprNode &node, Json val) {
+    if (results.size() >= maxResults)
+      results.clear();
+    results.emplace(node.text, std::move(val));
+  }
+
+  std::unordered_map<std::string, Json, TextHash, TextEqual> results;
+  Json document;
+  size_t maxResults = 4096;
+};
+
+// Maps paths of one `Json` document, by their canonical text (`.a.b[2].c`, as
+// in `ExprNode::text`), to their values. A path of keys and literal
+// subscripts then resolves with one hash probe instead of a walk from the
+// root, however deep it is. Paths are added up front by `build`, or as
+// expressions resolve them if `lazy` is set. Safe to share between threads
+// once built.
+//
+// Memory is bounded by `maxDepth` (in steps from the root), `subtrees` (only
+// paths under these, also canonical text, if any are given) and `maxEntries`.
+struct PathIndex {
+  explicit PathIndex(Json document) : document(std::move(document)) {}
+
+  // Adds every path within the bounds. Elements of packed numeric arrays are
+  // left out, as indexing them is already cheap.
+  void build() {
+    std::string path;
+    std::unique_lock lock(mutex);
+    addTree(path, document, 0);
+  }
+
+  void addTree(std::string &path, const Json &val, int depth) {
+    if (entries.size() >= maxEntries)
+      return;
+    if (depth > 0 && inSubtree(path))
+      entries.emplace(path, val);
+    if (depth == maxDepth || !(inSubtree(path) || aboveSubtree(path)))
+      return;
+    size_t length = path.size();
+    if (auto *obj = dynamic_cast<JsonObject *>(val.get())) {
+      for (auto &[id, member] : obj->members) {
+        std::string_view key = obj->keys->name(id);
+        // Expressions could not name it, and it could be mistaken for a path
+        if (!isIdentifier(key))
+          continue;
+        path += '.';
+        path += key;
+        addTree(path, member, depth + 1);
+        path.resize(length);
+      }
+    } else if (auto *arr = dynamic_cast<JsonArray *>(val.get())) {
+      for (size_t i = 0; i < arr->arr.size(); i++) {
+        path += '[' + std::to_string(i) + ']';
+        addTree(path, arr->arr[i], depth + 1);
+        path.resize(length);
+      }
+    }
+  }
+
+  // Returns nullptr if the path is not indexed
+  Json find(const ExprNode &node) const {
+    if (node.depth > maxDepth)
+      return nullptr;
+    // Nothing is added after `build` unless lazy
+    std::shared_lock lock(mutex, std::defer_lock);
+    if (lazy)
+      lock.lock();
+    auto it = entries.find(TextKey{node.text, node.hash});
+    return it == entries.end() ? nullptr : it->second;
+  }
+
+  // Ignored if the path is out of bounds
+  void add(const ExprNode &node, const Json &val) {
+    if (node.depth > maxDepth || !inSubtree(node.text))
+      return;
+    std::unique_lock lock(mutex);
+    if (entries.size() < maxEntries)
+      entries.emplace(node.text, val);
+  }
+
+  size_t size() const {
+    std::shared_lock lock(mutex);
+    return entries.size();
+  }
+
+  bool inSubtree(std::string_view path) const {
+    if (subtrees.empty())
+      return true;
+    for (auto &subtree : subtrees) {
+      if (path.starts_with(subtree) && isBoundary(path, subtree.size()))
+        return true;
+    }
+    return false;
+  }
+
+  bool aboveSubtree(std::string_view path) const {
+    for (std::string_view subtree : subtrees) {
+      if (subtree.starts_with(path) && isBoundary(subtree, path.size()))
+        return true;
+    }
+    return false;
+  }
+
+  static bool isBoundary(std::string_view path, size_t pos) {
+    return pos == path.size() || path[pos] == '.' || path[pos] == '[';
+  }
+
+  static bool isIdentifier(std::string_view key) {
+    if (key.empty() || !isalpha(static_cast<unsigned char>(key[0])))
+      return false;
+    for (unsigned char c : key) {
+      if (!isalnum(c) && c != '_')
+        return false;
+    }
+    return true;
+  }
+
+  Json document;
+  bool lazy = false;
+  int maxDepth = 16;
+  std::vector<std::string> subtrees;
+  size_t maxEntries = 1 << 20;
+  std::unordered_map<std::string, Json, TextHash, TextEqual> entries;
+  mutable std::shared_mutex mutex;
+};
+
+// What one evaluation keeps: the values of nodes with a slot, and optionally
+// a cache of results or an index of paths that outlives it
+template <class Value> struct ExprMemo {
+  explicit ExprMemo(int slots, ExprCache *cache = nullptr,
+                    PathIndex *paths = nullptr)
+      : slots(slots), cache(cache), paths(paths) {}
+
+  std::vector<std::optional<Value>> slots;
+  ExprCache *cache;
+  PathIndex *paths;
+};
+
+// How the evaluator reads and builds values of each document representation
+template <class Value> struct ExprValue;
+
+template <> struct ExprValue<Json> {
+  inline static Json literal(const ExprNode &node) { return node.literal; }
+  inline static Json getKey(const Json &val, const ExprNode &node) {
+    return val->getKeyCached(node.key, node.keyCache);
+  }
+  inline static Json getIndex(const Json &val, const Json &index) {
+    return val->getIndex(index->getInt());
+  }
+  inline static Json getIndexAt(const Json &val, int64_t index) {
+    return val->getIndex(index);
+  }
+  inline static std::optional<Json> findKey(const Json &val,
+                                            const ExprNode &node) {
+    if (Json *found = val->findKey(node.key, node.keyCache))
+      return *found;
+    return std::nullopt;
+  }
+  inline static std::optional<Json> findIndex(const Json &val,
+                                              const Json &index) {
+    return findIndexAt(val, index->getInt());
+  }
+  inline static std::optional<Json> findIndexAt(const Json &val,
+                                                int64_t index) {
+    if (Json found = val->findIndex(index))
+      return found;
+    return std::nullopt;
+  }
+  inline static Json null() {
+    static const Json value = std::make_shared<JsonNull>();
+    return value;
+  }
+  inline static bool isNull(const Json &val) {
+    return dynamic_cast<JsonNull *>(val.get());
+  }
+  inline static double getNumber(const Json &val) { return val->getNumber(); }
+  inline static Json size(const Json &val) {
+    return std::make_shared<JsonInt>(val->size());
+  }
+  inline static Json minMax(const Json &val, bool isMin) {
+    return isMin ? val->min() : val->max();
+  }
+};
+
+template <> struct ExprValue<JsonNode> {
+  inline static JsonNode literal(const ExprNode &node) {
+    return node.literalNode;
+  }
+  inline static JsonNode getKey(const JsonNode &val, const ExprNode &node) {
+    return val.getKey(node.key);
+  }
+  inline static JsonNode getIndex(const JsonNode &val, const JsonNode &index) {
+    return val.getIndex(index.getInt());
+  }
+  inline static JsonNode getIndexAt(const JsonNode &val, int64_t index) {
+    return val.getIndex(index);
+  }
+  inline static std::optional<JsonNode> findKey(const JsonNode &val,
+                                                const ExprNode &node) {
+    if (const JsonNode *found = val.findKey(node.key))
+      return *found;
+    return std::nullopt;
+  }
+  inline static std::optional<JsonNode> findIndex(const JsonNode &val,
+                                                  const JsonNode &index) {
+    return findIndexAt(val, index.getInt());
+  }
+  inline static std::optional<JsonNode> findIndexAt(const JsonNode &val,
+                                                    int64_t index) {
+    if (const JsonNode *found = val.findIndex(index))
+      return *found;
+    return std::nullopt;
+  }
+  inline static JsonNode null() { return JsonNode(); }
+  inline static bool isNull(const JsonNode &val) {
+    return val.type == JsonNodeType::NULL_;
+  }
+  inline static double getNumber(const JsonNode &val) {
+    return val.getNumber();
+  }
+  inline static JsonNode size(const JsonNode &val) {
+    return JsonNode::makeInt(val.size());
+  }
+  inline static JsonNode minMax(const JsonNode &val, bool isMin) {
+    return val.minMax(isMin);
+  }
+};
+
+enum class ExprOp : uint8_t {
+  // Pushes the document
+  GLOBAL,
+  // Pushes `node->literal`
+  LITERAL,
+  // Replaces the top with its member `node->key`
+  KEY,
+  // Pops the subscript and replaces the top with that element
+  INDEX,
+  // Replaces the top with element `index`
+  INDEX_AT,
+  // As KEY, INDEX and INDEX_AT, but a member or element that is not there
+  // gives null
+  OPT_KEY,
+  OPT_INDEX,
+  OPT_INDEX_AT,
+  // As KEY, INDEX and INDEX_AT, but a member or element that is not there
+  // cuts the stack to `height` and jumps to `arg`, the right of `??`
+  FIND_KEY,
+  FIND_INDEX,
+  FIND_INDEX_AT,
+  // Jumps to `arg` unless the top is null, which is popped
+  COALESCE,
+  // Reads the top as a number, for the MIN or MAX that follows
+  NUMBER,
+  // Pops `arg` values and pushes the least or greatest. With one, it is an
+  // array to reduce.
+  MIN,
+  MAX,
+  // Replaces the top with its size
+  SIZE,
+  // Copies the top to slot `arg`
+  SAVE,
+  // Pushes slot `arg`
+  LOAD,
+};
+
+struct ExprInstruction {
+  ExprOp op = ExprOp::GLOBAL;
+  uint16_t height = 0;
+  uint32_t arg = 0;
+  union {
+    const ExprNode *node = nullptr;
+    int64_t index;
+  };
+};
+
+// An expression lowered to a straight line of instructions on a stack of
+// values, so evaluating it is one loop rather than a recursive walk of the
+// DAG. A shared node is evaluated where it is first used and saved to its
+// slot, which later uses load. The stack and slots are on the C++ stack for
+// all but very large expressions.
+//
+// The only jumps are those of `??`. Shared nodes within it are not saved, as
+// they may be skipped.
+//
+// The instructions point into the DAG, which must outlive them.
+struct ExprProgram {
+  struct Lowering {
+    std::vector<bool> emitted;
+    // Height of the stack
+    int depth = 0;
+    // Within this many `??`
+    int conditional = 0;
+  };
+
+  // Lookups on the left of a `??`, which jump to its right when they miss
+  struct Fallback {
+    int height;
+    std::vector<size_t> misses;
+  };
+
+  static ExprProgram lower(const ExprNode &root) {
+    ExprProgram program;
+    Lowering state;
+    program.emit(root, state, nullptr);
+    return program;
+  }
+
+  // Pushes the value of `node`
+  void emit(const ExprNode &node, Lowering &state, Fallback *fallback) {
+    bool saving = false;
+    if (node.slot >= 0) {
+      if (size_t(node.slot) >= state.emitted.size())
+        state.emitted.resize(node.slot + 1);
+      if (state.emitted[node.slot]) {
+        add(ExprOp::LOAD, state, 1).arg = node.slot;
+        return;
+      }
+      if (state.conditional == 0) {
+        state.emitted[node.slot] = saving = true;
+        slots = std::max(slots, node.slot + 1);
+      }
+    }
+    switch (node.type) {
+    case ExprNodeType::GLOBAL:
+      add(ExprOp::GLOBAL, state, 1);
+      break;
+    case ExprNodeType::LITERAL:
+      add(ExprOp::LITERAL, state, 1).node = &node;
+      break;
+    case ExprNodeType::KEY:
+    case ExprNodeType::OPT_KEY:
+      emit(*node.base, state, fallback);
+      lookup(node, ExprOp::KEY, ExprOp::OPT_KEY, ExprOp::FIND_KEY, state,
+             fallback, 0)
+          .node = &node;
+      break;
+    case ExprNodeType::INDEX:
+    case ExprNodeType::OPT_INDEX: {
+      emit(*node.base, state, fallback);
+      const ExprNode &index = *node.args[0];
+      if (index.type == ExprNodeType::LITERAL &&
+          index.literalNode.type == JsonNodeType::INT) {
+        lookup(node, ExprOp::INDEX_AT, ExprOp::OPT_INDEX_AT,
+               ExprOp::FIND_INDEX_AT, state, fallback, 0)
+            .index = index.literalNode.integer;
+      } else {
+        emit(index, state, fallback);
+        lookup(node, ExprOp::INDEX, ExprOp::OPT_INDEX, ExprOp::FIND_INDEX,
+               state, fallback, -1);
+      }
+      break;
+    }
+    case ExprNodeType::MIN:
+    case ExprNodeType::MAX: {
+      // Each argument is read as a number before the next is evaluated, as
+      // `CompiledExpr::evalMinMax` does, so the same error is reported first
+      int count = node.args.size();
+      for (auto &arg : node.args) {
+        emit(*arg, state, fallback);
+        if (count > 1)
+          add(ExprOp::NUMBER, state, 0);
+      }
+      ExprOp op = node.type == ExprNodeType::MIN ? ExprOp::MIN : ExprOp::MAX;
+      add(op, state, 1 - count).arg = count;
+      break;
+    }
+    case ExprNodeType::SIZE:
+      emit(*node.args[0], state, fallback);
+      add(ExprOp::SIZE, state, 0);
+      break;
+    case ExprNodeType::COALESCE: {
+      // The right is evaluated as usual, as `CompiledExpr` does
+      Fallback left{state.depth, {}};
+      state.conditional++;
+      emit(*node.args[0], state, &left);
+      size_t test = code.size();
+      add(ExprOp::COALESCE, state, -1);
+      for (size_t miss : left.misses)
+        code[miss].arg = code.size();
+      emit(*node.args[1], state, nullptr);
+      code[test].arg = code.size();
+      state.conditional--;
+      break;
+    }
+    }
+    if (saving)
+      add(ExprOp::SAVE, state, 0).arg = node.slot;
+  }
+
+  // The variant of a lookup for `node` and where it is
+  ExprInstruction &lookup(const ExprNode &node, ExprOp strict, ExprOp optional,
+                          ExprOp find, Lowering &state, Fallback *fallback,
+                          int pushed) {
+    bool isOptional = node.type == ExprNodeType::OPT_KEY ||
+                      node.type == ExprNodeType::OPT_INDEX;
+    if (isOptional || !fallback)
+      return add(isOptional ? optional : strict, state, pushed);
+    fallback->misses.push_back(code.size());
+    ExprInstruction &ins = add(find, state, pushed);
+    ins.height = fallback->height;
+    return ins;
+  }
+
+  ExprInstruction &add(ExprOp op, Lowering &state, int pushed) {
+    state.depth += pushed;
+    stackSize = std::max(stackSize, state.depth);
+    ExprInstruction instruction;
+    instruction.op = op;
+    return code.emplace_back(instruction);
+  }
+
+  template <class Value> Value run(const Value &global) const {
+    size_t count = stackSize + slots;
+    if (count > inlineValues) {
+      std::vector<Value> values(count);
+      std::vector<double> numbers(stackSize);
+      return exec(values.data(), numbers.data(), global);
+    }
+    // Only as many values as are used are made, as for most paths that is one
+    alignas(Value) std::byte storage[inlineValues * sizeof(Value)];
+    double numbers[inlineValues];
+    Value *values = reinterpret_cast<Value *>(storage);
+    std::uninitialized_value_construct_n(values, count);
+    struct Destroy {
+      ~Destroy() { std::destroy_n(values, count); }
+      Value *values;
+      size_t count;
+    } destroy{values, count};
+    return exec(values, numbers, global);
+  }
+
+  // `values` holds the stack then the slots. `numbers` holds what NUMBER read
+  // from the value at the same height.
+  template <class Value>
+  Value exec(Value *values, double *numbers, const Value &global) const {
+    using V = ExprValue<Value>;
+    // One past the top
+    Value *end = values;
+    Value *saved = values + stackSize;
+    for (size_t pc = 0; pc < code.size();) {
+      const ExprInstruction &ins = code[pc++];
+      switch (ins.op) {
+      case ExprOp::GLOBAL:
+        *end++ = global;
+        break;
+      case ExprOp::LITERAL:
+        *end++ = V::literal(*ins.node);
+        break;
+      case ExprOp::KEY:
+        end[-1] = V::getKey(end[-1], *ins.node);
+        break;
+      case ExprOp::INDEX:
+        end[-2] = V::getIndex(end[-2], end[-1]);
+        end--;
+        break;
+      case ExprOp::INDEX_AT:
+        end[-1] = V::getIndexAt(end[-1], ins.index);
+        break;
+      case ExprOp::OPT_KEY:
+        if (auto found = V::findKey(end[-1], *ins.node))
+          end[-1] = std::move(*found);
+        else
+          end[-1] = V::null();
+        break;
+      case ExprOp::OPT_INDEX:
+        if (auto found = V::findIndex(end[-2], end[-1]))
+          end[-2] = std::move(*found);
+        else
+          end[-2] = V::null();
+        end--;
+        break;
+      case ExprOp::OPT_INDEX_AT:
+        if (auto found = V::findIndexAt(end[-1], ins.index))
+          end[-1] = std::move(*found);
+        else
+          end[-1] = V::null();
+        break;
+      case ExprOp::FIND_KEY:
+        if (auto found = V::findKey(end[-1], *ins.node)) {
+          end[-1] = std::move(*found);
+        } else {
+          end = values + ins.height;
+          pc = ins.arg;
+        }
+        break;
+      case ExprOp::FIND_INDEX:
+        if (auto found = V::findIndex(end[-2], end[-1])) {
+          end[-2] = std::move(*found);
+          end--;
+        } else {
+          end = values + ins.height;
+          pc = ins.arg;
+        }
+        break;
+      case ExprOp::FIND_INDEX_AT:
+        if (auto found = V::findIndexAt(end[-1], ins.index)) {
+          end[-1] = std::move(*found);
+        } else {
+          end = values + ins.height;
+          pc = ins.arg;
+        }
+        break;
+      case ExprOp::COALESCE:
+        if (!V::isNull(end[-1]))
+          pc = ins.arg;
+        else
+          end--;
+        break;
+      case ExprOp::NUMBER:
+        numbers[end - 1 - values] = V::getNumber(end[-1]);
+        break;
+      case ExprOp::MIN:
+      case ExprOp::MAX: {
+        bool isMin = ins.op == ExprOp::MIN;
+        if (ins.arg == 1) {
+          end[-1] = V::minMax(end[-1], isMin);
+          break;
+        }
+        Value *first = end - ins.arg;
+        double *nums = numbers + (first - values);
+        uint32_t best = 0;
+        for (uint32_t i = 1; i < ins.arg; i++) {
+          if (isMin ? nums[i] < nums[best] : nums[i] > nums[best])
+            best = i;
+        }
+        if (best != 0)
+          first[0] = std::move(first[best]);
+        end = first + 1;
+        break;
+      }
+      case ExprOp::SIZE:
+        end[-1] = V::size(end[-1]);
+        break;
+      case ExprOp::SAVE:
+        saved[ins.arg] = end[-1];
+        break;
+      case ExprOp::LOAD:
+        *end++ = saved[ins.arg];
+        break;
+      }
+    }
+    return std::move(end[-1]);
+  }
+
+  inline static constexpr int inlineValues = 8;
+  std::vector<ExprInstruction> code;
+  int stackSize = 0;
+  int slots = 0;
+};
+
+// An expression parsed once by `ExprParser::compile` which can then be
+// evaluated against any number of documents. It is a DAG: a subexpression
+// that appears more than once, e.g. `a.b` in `a.b[a.b[1]]`, is one node, and
+// is evaluated once per evaluation.
+struct CompiledExpr {
+  inline Json eval(const Json &global) const { return evalRoot(global); }
+
+  // Reuses results `cache` holds from earlier evaluations against `global`
+  inline Json eval(const Json &global, ExprCache &cache) const {
+    cache.use(global);
+    ExprMemo<Json> memo(slots, &cache);
+    return evalNode(*root, global, &memo);
+  }
+
+  // Against the indexed document, resolving paths through the index
+  inline Json eval(PathIndex &index) const {
+    ExprMemo<Json> memo(slots, nullptr, &index);
+    return evalNode(*root, index.document, &memo);
+  }
+
+  // The result refers into `doc`, so it is only valid while `doc` is alive
+  inline JsonNode eval(const Document &doc) const {
+    return evalRoot(doc.root);
+  }
+
+  template <class Value> inline Value evalRoot(const Value &global) const {
+    if (!program.code.empty())
+      return program.run(global);
+    if (slots == 0)
+      return evalNode(*root, global);
+    ExprMemo<Value> memo(slots);
+    return evalNode(*root, global, &memo);
+  }
+
+  template <class Value>
+  inline static Value evalNode(const ExprNode &node, const Value &global,
+                               ExprMemo<Value> *memo = nullptr) {
+    if (!memo)
+      return evalStep(node, global, memo);
+    if (node.slot >= 0) {
+      std::optional<Value> &saved = memo->slots[node.slot];
+      if (!saved)
+        saved = evalCached(node, global, memo);
+      return *saved;
+    }
+    return evalCached(node, global, memo);
+  }
+
+  template <class Value>
+  inline static Value evalCached(const ExprNode &node, const Value &global,
+                                 ExprMemo<Value> *memo) {
+    if constexpr (std::is_same_v<Value, Json>) {
+      bool cheap = node.type == ExprNodeType::GLOBAL ||
+                   node.type == ExprNodeType::LITERAL;
+      if (memo->paths && node.literalPath && !cheap) {
+        if (Json found = memo->paths->find(node))
+          return found;
+        Json val = evalStep(node, global, memo);
+        if (memo->paths->lazy)
+          memo->paths->add(node, val);
+        return val;
+      }
+      if (memo->cache && !cheap) {
+        if (const Json *saved = memo->cache->find(node))
+          return *saved;
+        Json val = evalStep(node, global, memo);
+        memo->cache->insert(node, val);
+        return val;
+      }
+    }
+    return evalStep(node, global, memo);
+  }
+
+  template <class Value>
+  inline static Value evalStep(const ExprNode &node, const Value &global,
+                               ExprMemo<Value> *memo) {
+    using V = ExprValue<Value>;
+    switch (node.type) {
+    case ExprNodeType::GLOBAL:
+      return global;
+
+    case ExprNodeType::LITERAL:
+      return V::literal(node);
+
+    case ExprNodeType::KEY:
+      return V::getKey(evalNode(*node.base, global, memo), node);
+
+    case ExprNodeType::INDEX: {
+      Value base = evalNode(*node.base, global, memo);
+      return V::getIndex(base, evalNode(*node.args[0], global, memo));
+    }
+
+    case ExprNodeType::MIN:
+    case ExprNodeType::MAX:
+      return *evalMinMax<Value>(
+          node, node.type == ExprNodeType::MIN,
+          [&](const ExprNode &arg) -> std::optional<Value> {
+            return evalNode(arg, global, memo);
+          });
+
+    case ExprNodeType::SIZE:
+      return V::size(evalNode(*node.args[0], global, memo));
+
+    case ExprNodeType::OPT_KEY:
+      if (auto found = V::findKey(evalNode(*node.base, global, memo), node))
+        return *found;
+      return V::null();
+
+    case ExprNodeType::OPT_INDEX: {
+      Value base = evalNode(*node.base, global, memo);
+      if (auto found =
+              V::findIndex(base, evalNode(*node.args[0], global, memo)))
+        return *found;
+      return V::null();
+    }
+
+    case ExprNodeType::COALESCE: {
+      std::optional<Value> val = evalOptional(*node.args[0], global, memo);
+      if (val && !V::isNull(*val))
+        return *val;
+      return evalNode(*node.args[1], global, memo);
+    }
+    }
+    throw; // Unreachable
+  }
+
+  // As `evalNode`, but nullopt where a key or index is not in the document,
+  // for the left of `??`
+  template <class Value>
+  inline static std::optional<Value>
+  evalOptional(const ExprNode &node, const Value &global,
+               ExprMemo<Value> *memo) {
+    using V = ExprValue<Value>;
+    std::optional<Value> *saved =
+        memo && node.slot >= 0 ? &memo->slots[node.slot] : nullptr;
+    if (saved && *saved)
+      return *saved;
+    std::optional<Value> val;
+    switch (node.type) {
+    case ExprNodeType::KEY:
+    case ExprNodeType::OPT_KEY: {
+      std::optional<Value> base = evalOptional(*node.base, global, memo);
+      if (!base)
+        return std::nullopt;
+      val = V::findKey(*base, node);
+      break;
+    }
+    case ExprNodeType::INDEX:
+    case ExprNodeType::OPT_INDEX: {
+      std::optional<Value> base = evalOptional(*node.base, global, memo);
+      if (!base)
+        return std::nullopt;
+      std::optional<Value> index = evalOptional(*node.args[0], global, memo);
+      if (!index)
+        return std::nullopt;
+      val = V::findIndex(*base, *index);
+      break;
+    }
+    case ExprNodeType::MIN:
+    case ExprNodeType::MAX:
+      val = evalMinMax<Value>(node, node.type == ExprNodeType::MIN,
+                              [&](const ExprNode &arg) {
+                                return evalOptional(arg, global, memo);
+                              });
+      break;
+    case ExprNodeType::SIZE: {
+      std::optional<Value> arg = evalOptional(*node.args[0], global, memo);
+      if (!arg)
+        return std::nullopt;
+      val = V::size(*arg);
+      break;
+    }
+    default:
+      return evalNode(node, global, memo);
+    }
+    if (!val && (node.type == ExprNodeType::OPT_KEY ||
+                 node.type == ExprNodeType::OPT_INDEX))
+      val = V::null();
+    if (saved && val)
+      *saved = val;
+    return val;
+  }
+
+  // `evalArg` gives the value of an argument, or nullopt to give up
+  template <class Value, class EvalArg>
+  inline static std::optional<Value>
+  evalMinMax(const ExprNode &node, bool isMin, EvalArg &&evalArg) {
+    using V = ExprValue<Value>;
+    std::optional<Value> best_obj = evalArg(*node.args[0]);
+    if (!best_obj)
+      return std::nullopt;
+    if (node.args.size() == 1)
+      return V::minMax(*best_obj, isMin);
+    double best_val = V::getNumber(*best_obj);
+    for (size_t i = 1; i < node.args.size(); i++) {
+      std::optional<Value> obj = evalArg(*node.args[i]);
+      if (!obj)
+        return std::nullopt;
+      double val = V::getNumber(*obj);
+      if (isMin ? val < best_val : val > best_val) {
+        best_val = val;
+        best_obj = std::move(obj);
+      }
+    }
+    return best_obj;
+  }
+
+  Expr root;
+  int slots = 0;
+  // Set by `ExprParser::compile`. Caches and path indexes walk `root`
+  // instead, as they look up every node.
+  ExprProgram program;
+};
+
+// The outcome of one expression of an `ExprBatch`
+template <class Value> struct BatchResult {
+  Value value;
+  // Empty unless the expression failed, in which case `value` is unset. Says
+  // how it failed, e.g. "Invalid Operation: Cannot index int".
+  std::string error;
+};
+
+// Several expressions compiled together by `ExprParser::compileBatch`, to be
+// evaluated against the same documents. Subexpressions they have in common,
+// e.g. `a.b` in `a.b[0]` and `size(a.b)`, are shared nodes that are evaluated
+// once per document.
+struct ExprBatch {
+  inline std::vector<BatchResult<Json>> eval(const Json &global) const {
+    return evalAll(global);
+  }
+
+  // The results refer into `doc`, so they are only valid while `doc` is alive
+  inline std::vector<BatchResult<JsonNode>> eval(const Document &doc) const {
+    return evalAll(doc.root);
+  }
+
+  inline std::vector<BatchResult<Json>> eval(const Json &global,
+                                             ExprCache &cache) const {
+    cache.use(global);
+    return evalAll(global, &cache);
+  }
+
+  inline std::vector<BatchResult<Json>> eval(PathIndex &index) const {
+    return evalAll(index.document, nullptr, &index);
+  }
+
+  // An expression that fails does not stop the others
+  template <class Value>
+  inline std::vector<BatchResult<Value>>
+  evalAll(const Value &global, ExprCache *cache = nullptr,
+          PathIndex *paths = nullptr) const {
+    ExprMemo<Value> memo(slots, cache, paths);
+    std::vector<BatchResult<Value>> results(exprs.size());
+    for (size_t i = 0; i < exprs.size(); i++) {
+      if (!exprs[i].root) {
+        results[i].error = "Expr Parse Error: " + parseErrors[i];
+        continue;
+      }
+      try {
+        results[i].value =
+            CompiledExpr::evalNode(*exprs[i].root, global, &memo);
+      } catch (InvalidOperation &x) {
+        results[i].error = std::string("Invalid Operation: ") + x.what();
+      }
+    }
+    return results;
+  }
+
+  std::vector<CompiledExpr> exprs;
+  // Why each expression without a root did not parse
+  std::vector<std::string> parseErrors;
+  int slots = 0;
+};
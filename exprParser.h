@@ -1,21 +1,57 @@
 #pragma once
+#include <cmath>
 #include <format>
 #include <iostream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
+#include "expr.h"
 #include "exprTokeniser.h"
 #include "json.h"
+#include "jsonTokeniser.h"
+#include "jsonWriter.h"
 
 struct ExprParser {
-  Json parse(Json json, const std::string &input_) {
+  CompiledExpr compile(const std::string &input_) {
+    nodes.clear();
+    CompiledExpr expr = compileRoot(input_);
+    nodes.clear();
+    expr.slots = assignSlots({expr.root.get()});
+    expr.program = ExprProgram::lower(*expr.root);
+    return expr;
+  }
+
+  // Subexpressions the expressions have in common are compiled to the same
+  // nodes, so they are only evaluated once. An expression that does not parse
+  // is left without a root, and fails on its own when evaluated.
+  ExprBatch compileBatch(const std::vector<std::string> &inputs) {
+    nodes.clear();
+    ExprBatch batch;
+    batch.parseErrors.resize(inputs.size());
+    std::vector<ExprNode *> roots;
+    for (size_t i = 0; i < inputs.size(); i++) {
+      try {
+        batch.exprs.push_back(compileRoot(inputs[i]));
+        roots.push_back(batch.exprs.back().root.get());
+      } catch (ExprParseError &x) {
+        batch.exprs.emplace_back();
+        batch.parseErrors[i] = x.what();
+      }
+    }
+    nodes.clear();
+    batch.slots = assignSlots(roots);
+    return batch;
+  }
+
+  CompiledExpr compileRoot(const std::string &input_) {
     input = input_;
     tokeniser.tokenise(input);
     // for (auto [type, a, b] : tokeniser.tokens) {
     //   std::cout << std::format("{}\n", printExprToken(type));
     // }
     pos = 0;
-    global = json;
-    Json ret = parseHelper();
+    Expr ret = parseCoalesce();
     if (tokeniser.tokens[pos].type != ExprTokenType::EOF_) {
       // std::cout << pos << ' ' << printExprToken(tokeniser.tokens[pos].type)
       //           << std::endl;
@@ -23,165 +59,261 @@ struct ExprParser {
     }
     if (!ret)
       throw ExprParseError("Empty expression");
-    return ret;
+    CompiledExpr expr;
+    expr.root = ret;
+    return expr;
   }
 
-  Json parseMinMax(bool isMin) {
+  Json parse(Json json, const std::string &input_) {
+    return compile(input_).eval(json);
+  }
+
+  Expr parseMinMax(ExprNodeType type) {
     if (tokeniser.tokens[pos++].type != ExprTokenType::LEFT_ROUND)
       throw ExprParseError("Expected bracket after min/max");
-    std::vector<Json> args;
+    Expr node = makeNode(type);
     while (true) {
-      auto arg = parseHelper();
+      auto arg = parseCoalesce();
       if (!arg)
         throw ExprParseError("Empty expression");
-      args.push_back(arg);
+      node->args.push_back(arg);
       ExprTokenType type = tokeniser.tokens[pos++].type;
       if (type == ExprTokenType::RIGHT_ROUND)
         break;
       if (type != ExprTokenType::COMMA)
         throw ExprParseError("Expected comma after argument");
     }
-    if (args.size() == 1) {
-      std::shared_ptr<JsonArray> arr =
-          std::dynamic_pointer_cast<JsonArray>(args[0]);
-      if (!arr)
-        throw InvalidOperation("Can only take min/max of array");
-      return isMin ? arr->min() : arr->max();
-    } else {
-      Json best_obj = args[0];
-      double best_val = best_obj->getNumber();
-      for (int i = 1; i < args.size(); i++) {
-        Json obj = args[i];
-        double val = obj->getNumber();
-        if (isMin) {
-          if (val < best_val) {
-            best_val = val;
-            best_obj = obj;
-          }
-        } else {
-          if (val > best_val) {
-            best_val = val;
-            best_obj = obj;
-          }
-        }
-      }
-      return best_obj;
-    }
+    return intern(node);
   }
-  Json parseSize() {
+
+  Expr parseSize() {
     if (tokeniser.tokens[pos++].type != ExprTokenType::LEFT_ROUND)
       throw ExprParseError("Expected opening bracket after size");
-    Json val = parseHelper();
+    Expr val = parseCoalesce();
     if (!val)
       throw ExprParseError("Empty expression");
     if (tokeniser.tokens[pos++].type != ExprTokenType::RIGHT_ROUND)
       throw ExprParseError("Expected closing bracket after argument to size");
-    return std::make_shared<JsonInt>(val->size());
+    Expr node = makeNode(ExprNodeType::SIZE);
+    node->args.push_back(val);
+    return intern(node);
   }
 
-  Json parseHelper() {
-    Json current = nullptr;
-    int first = pos;
-    while (pos < tokeniser.tokens.size()) {
+  // `??` binds loosest, and to the right. Returns nullptr if the expression is
+  // empty.
+  Expr parseCoalesce() {
+    Expr left = parseHelper();
+    if (tokeniser.tokens[pos].type != ExprTokenType::COALESCE)
+      return left;
+    pos++;
+    Expr right = parseCoalesce();
+    if (!left || !right)
+      throw ExprParseError("Empty expression");
+    Expr node = makeNode(ExprNodeType::COALESCE);
+    node->args = {left, right};
+    return intern(node);
+  }
+
+  // Returns nullptr if the expression is empty
+  Expr parseHelper() {
+    Expr current = nullptr;
+    auto [type, start, end] = tokeniser.tokens[pos];
+    switch (type) {
+    case ExprTokenType::MIN:
+      pos++;
+      current = parseMinMax(ExprNodeType::MIN);
+      break;
+    case ExprTokenType::MAX:
+      pos++;
+      current = parseMinMax(ExprNodeType::MAX);
+      break;
+    case ExprTokenType::SIZE:
+      pos++;
+      current = parseSize();
+      break;
+    case ExprTokenType::INT: {
+      pos++;
+      std::string_view text(input.data() + start, end - start + 1);
+      int64_t val;
+      if (decodeInt(text, val)) {
+        current =
+            makeLiteral(std::make_shared<JsonInt>(val), JsonNode::makeInt(val));
+      } else {
+        double number = decodeDouble(text);
+        current = makeLiteral(std::make_shared<JsonNumber>(number),
+                              JsonNode::makeNumber(number));
+      }
+      break;
+    }
+    case ExprTokenType::NUMBER: {
+      pos++;
+      double val =
+          decodeDouble(std::string_view(input.data() + start, end - start + 1));
+      current = makeLiteral(std::make_shared<JsonNumber>(val),
+                            JsonNode::makeNumber(val));
+      break;
+    }
+    case ExprTokenType::IDENT:
+      pos++;
+      current =
+          makeKey(makeGlobal(), input.substr(start, end - start + 1));
+      break;
+    case ExprTokenType::LEFT_SQUARE:
+      // A leading subscript indexes the document itself
+      current = makeGlobal();
+      break;
+    case ExprTokenType::DOT:
+      throw ExprParseError("Unexpected dot");
+    default:
+      return nullptr;
+    }
+
+    while (true) {
       auto [type, start, end] = tokeniser.tokens[pos];
       switch (type) {
-      case ExprTokenType::MIN: {
-        if (pos != first)
-          throw ExprParseError("Unexpected min");
+      case ExprTokenType::LEFT_SQUARE:
         pos++;
-        current = parseMinMax(true);
-        pos--;
+        current = makeIndex(current, parseSubscript(), ExprNodeType::INDEX);
         break;
-      }
-      case ExprTokenType::MAX: {
-        if (pos != first)
-          throw ExprParseError("Unexpected max");
-        pos++;
-        current = parseMinMax(false);
-        pos--;
-        break;
-      }
-      case ExprTokenType::SIZE: {
-        if (pos != first)
-          throw ExprParseError("Unexpected size");
-        pos++;
-        current = parseSize();
-        pos--;
-        break;
-      }
-      case ExprTokenType::LEFT_SQUARE: {
-        pos++;
-        Json index = parseHelper();
-        if (pos == tokeniser.tokens.size() ||
-            tokeniser.tokens[pos].type != ExprTokenType::RIGHT_SQUARE)
-          throw ExprParseError("Expected closing bracket for subscript");
-        if (!index)
-          throw ExprParseError("Expected index");
-        if (!current)
-          current = global;
-        current = current->getIndex(index->getInt());
+      case ExprTokenType::QUESTION_DOT: {
+        auto [nextType, nextStart, nextEnd] = tokeniser.tokens[pos + 1];
+        pos += 2;
+        if (nextType == ExprTokenType::IDENT)
+          current = makeKey(current,
+                            input.substr(nextStart, nextEnd - nextStart + 1),
+                            ExprNodeType::OPT_KEY);
+        else if (nextType == ExprTokenType::LEFT_SQUARE)
+          current =
+              makeIndex(current, parseSubscript(), ExprNodeType::OPT_INDEX);
+        else
+          throw ExprParseError("Expected identifier or subscript after ?.");
         break;
       }
-      case ExprTokenType::RIGHT_SQUARE:
-        return current;
-      case ExprTokenType::LEFT_ROUND:
-        return current;
-      case ExprTokenType::RIGHT_ROUND:
-        return current;
-      case ExprTokenType::INT:
-        current = std::make_shared<JsonInt>(
-            std::stoi(input.substr(start, end - start + 1)));
-        break;
-      case ExprTokenType::NUMBER:
-        current = std::make_shared<JsonNumber>(
-            std::stod(input.substr(start, end - start + 1)));
-        break;
-      case ExprTokenType::DOT:
-        if (!current)
-          throw ExprParseError("Unexpected dot");
-        if (pos + 1 == tokeniser.tokens.size() ||
-            tokeniser.tokens[pos + 1].type != ExprTokenType::IDENT)
+      case ExprTokenType::DOT: {
+        auto [nextType, nextStart, nextEnd] = tokeniser.tokens[pos + 1];
+        if (nextType != ExprTokenType::IDENT)
           throw ExprParseError("Expected identifier after dot");
-        break;
-      case ExprTokenType::COMMA:
-        return current;
-      case ExprTokenType::IDENT: {
-        std::string ident = input.substr(start, end - start + 1);
-        if (!current)
-          current = global;
-        else {
-          if (pos > 0 && tokeniser.tokens[pos - 1].type != ExprTokenType::DOT)
-            throw ExprParseError("Unexpected identifier");
-        }
-        current = current->getKey(ident);
+        current =
+            makeKey(current, input.substr(nextStart, nextEnd - nextStart + 1));
+        pos += 2;
         break;
       }
-      case ExprTokenType::EOF_:
+      case ExprTokenType::IDENT:
+        throw ExprParseError("Unexpected identifier");
+      case ExprTokenType::MIN:
+        throw ExprParseError("Unexpected min");
+      case ExprTokenType::MAX:
+        throw ExprParseError("Unexpected max");
+      case ExprTokenType::SIZE:
+        throw ExprParseError("Unexpected size");
+      default:
         return current;
       }
-      pos++;
     }
-    return current;
-    throw; // Unreachable
   }
 
-  void parseArray(std::vector<Json> &arr) {
-    if (tokeniser.tokens.back().type == ExprTokenType::RIGHT_ROUND)
-      return;
+  // After the opening bracket
+  Expr parseSubscript() {
+    Expr index = parseCoalesce();
+    if (tokeniser.tokens[pos].type != ExprTokenType::RIGHT_SQUARE)
+      throw ExprParseError("Expected closing bracket for subscript");
+    if (!index)
+      throw ExprParseError("Expected index");
+    pos++;
+    return index;
+  }
 
-    // Trailing commas not allowed
-    while (pos < tokeniser.tokens.size()) {
-      // arr.push_back(parseHelper());
-      auto type = tokeniser.tokens[pos++].type;
-      if (type == ExprTokenType::RIGHT_ROUND)
-        return;
-      if (type != ExprTokenType::COMMA)
-        throw ExprParseError("Comma expected between elements of array");
+  Expr makeNode(ExprNodeType type) {
+    Expr node = std::make_shared<ExprNode>();
+    node->type = type;
+    return node;
+  }
+
+  Expr makeLiteral(Json literal, JsonNode literalNode) {
+    Expr node = makeNode(ExprNodeType::LITERAL);
+    node->literal = literal;
+    node->literalNode = literalNode;
+    return intern(node);
+  }
+
+  Expr makeGlobal() { return intern(makeNode(ExprNodeType::GLOBAL)); }
+
+  Expr makeKey(Expr base, const std::string &key,
+               ExprNodeType type = ExprNodeType::KEY) {
+    Expr node = makeNode(type);
+    node->base = base;
+    node->key = key;
+    return intern(node);
+  }
+
+  Expr makeIndex(Expr base, Expr index, ExprNodeType type) {
+    Expr node = makeNode(type);
+    node->base = base;
+    node->args.push_back(index);
+    return intern(node);
+  }
+
+  // Gives `node` its canonical text, built from its children's, and returns
+  // the node already compiled with the same text if there is one
+  Expr intern(Expr node) {
+    std::string &text = node->text;
+    switch (node->type) {
+    case ExprNodeType::GLOBAL:
+      break;
+    case ExprNodeType::LITERAL:
+      if (node->literalNode.type == JsonNodeType::INT) {
+        text = std::to_string(node->literalNode.integer);
+      } else if (!std::isfinite(node->literalNode.number)) {
+        // Overflowing literals such as 1e999; the writer gives both as null
+        text = node->literalNode.number < 0 ? "-inf" : "inf";
+      } else {
+        // Always with a fraction or exponent, so 1.0 differs from 1
+        JsonWriter writer(text);
+        writer.number(node->literalNode.number);
+      }
+      break;
+    case ExprNodeType::KEY:
+      text = node->base->text + "." + node->key;
+      break;
+    case ExprNodeType::INDEX:
+      text = node->base->text + "[" + node->args[0]->text + "]";
+      break;
+    case ExprNodeType::OPT_KEY:
+      text = node->base->text + "?." + node->key;
+      break;
+    case ExprNodeType::OPT_INDEX:
+      text = node->base->text + "?.[" + node->args[0]->text + "]";
+      break;
+    case ExprNodeType::COALESCE:
+      text = "(" + node->args[0]->text + " ?? " + node->args[1]->text + ")";
+      break;
+    case ExprNodeType::MIN:
+    case ExprNodeType::MAX:
+    case ExprNodeType::SIZE:
+      text = node->type == ExprNodeType::MIN   ? "min("
+             : node->type == ExprNodeType::MAX ? "max("
+                                               : "size(";
+      for (size_t i = 0; i < node->args.size(); i++)
+        text += (i ? ", " : "") + node->args[i]->text;
+      text += ")";
+      break;
     }
+    node->literalPath =
+        node->type == ExprNodeType::GLOBAL ||
+        (node->type == ExprNodeType::KEY && node->base->literalPath) ||
+        (node->type == ExprNodeType::INDEX && node->base->literalPath &&
+         node->args[0]->type == ExprNodeType::LITERAL &&
+         node->args[0]->literalNode.type == JsonNodeType::INT);
+    if (node->base)
+      node->depth = node->base->depth + 1;
+    node->hash = fnv1a(text);
+    auto [it, inserted] = nodes.try_emplace(text, node);
+    return it->second;
   }
 
   std::string input;
-  Json global;
   int pos;
   ExprTokeniser tokeniser;
+  // Nodes compiled so far, by canonical text
+  std::unordered_map<std::string, Expr> nodes;
 };
@@ -18,6 +18,8 @@ enum class ExprTokenType {
   DOT,
   COMMA,
   IDENT,
+  QUESTION_DOT,
+  COALESCE,
   EOF_,
 };
 
@@ -53,6 +55,10 @@ inline std::string printExprToken(ExprTokenType t) {
     return "COMMA";
   case ExprTokenType::IDENT:
     return "IDENT";
+  case ExprTokenType::QUESTION_DOT:
+    return "QUESTION_DOT";
+  case ExprTokenType::COALESCE:
+    return "COALESCE";
   case ExprTokenType::EOF_:
     return "EOF";
   }
@@ -76,24 +82,6 @@ struct ExprTokeniser {
         pos++;
         break;
 
-      case 'm':
-        if (input.substr(pos, 3) == "min") {
-          tokens.emplace_back(ExprTokenType::MIN, pos, pos + 2);
-        } else if (input.substr(pos, 3) == "max") {
-          tokens.emplace_back(ExprTokenType::MAX, pos, pos + 2);
-        } else {
-          throw ExprParseError("Invalid keyword");
-        }
-        pos += 3;
-        break;
-
-      case 's':
-        if (input.substr(pos, 4) != "size")
-          throw ExprParseError("Invalid keyword");
-        tokens.emplace_back(ExprTokenType::SIZE, pos, pos + 3);
-        pos += 4;
-        break;
-
       case '[':
         tokens.emplace_back(ExprTokenType::LEFT_SQUARE, pos, pos);
         pos++;
@@ -124,6 +112,16 @@ struct ExprTokeniser {
         pos++;
         break;
 
+      case '?':
+        if (pos + 1 < int(input.size()) && input[pos + 1] == '.')
+          tokens.emplace_back(ExprTokenType::QUESTION_DOT, pos, pos + 1);
+        else if (pos + 1 < int(input.size()) && input[pos + 1] == '?')
+          tokens.emplace_back(ExprTokenType::COALESCE, pos, pos + 1);
+        else
+          throw ExprParseError("Expected . or ? after ?");
+        pos += 2;
+        break;
+
       default: {
         if (input[pos] == '-' || isdigit(input[pos])) {
           tokens.emplace_back(ExprTokenType::INT, pos, pos);
@@ -132,6 +130,7 @@ struct ExprTokeniser {
         } else if (isalpha(input[pos])) {
           tokens.emplace_back(ExprTokenType::IDENT, pos, pos);
           tokenIdent();
+          tokenKeyword();
         } else {
           throw ExprParseError(std::string("Unexpected character: ") +
                                input[pos]);
@@ -144,34 +143,54 @@ struct ExprTokeniser {
     tokens.push_back({ExprTokenType::EOF_, pos, pos});
   }
 
+  // Digits, of which there must be at least one
   void tokenNum() {
-    while (pos < input.size()) {
-      if (!isdigit(input[pos]))
-        return;
+    if (pos >= int(input.size()) || !isdigit(input[pos]))
+      throw ExprParseError("Expected digit in number");
+    while (pos < int(input.size()) && isdigit(input[pos]))
       tokens.back().end = pos++;
-    }
   }
 
+  // Lexes the rest of a number after its first character. Anything with a
+  // fraction or exponent is a NUMBER.
   void tokenInt() {
-    while (pos < input.size()) {
-      if (input[pos] == '.') {
-        tokens.back().type = ExprTokenType::NUMBER;
-        pos++;
-        tokenNum();
-        return;
-      }
-      if (!isdigit(input[pos]))
-        return;
+    if (input[pos - 1] == '-')
+      tokenNum();
+    while (pos < int(input.size()) && isdigit(input[pos]))
       tokens.back().end = pos++;
+    if (pos < int(input.size()) && input[pos] == '.') {
+      tokens.back().type = ExprTokenType::NUMBER;
+      pos++;
+      tokenNum();
+    }
+    if (pos < int(input.size()) && (input[pos] == 'e' || input[pos] == 'E')) {
+      tokens.back().type = ExprTokenType::NUMBER;
+      pos++;
+      if (pos < int(input.size()) && (input[pos] == '+' || input[pos] == '-'))
+        pos++;
+      tokenNum();
     }
   }
 
   void tokenIdent() {
-    while (pos < input.size() && isalpha(input[pos])) {
+    while (pos < int(input.size()) &&
+           (isalnum(input[pos]) || input[pos] == '_')) {
       tokens.back().end = pos++;
     }
   }
 
+  // Identifiers such as `msg` or `sizes` are only keywords on an exact match
+  void tokenKeyword() {
+    auto &token = tokens.back();
+    std::string ident = input.substr(token.start, token.end - token.start + 1);
+    if (ident == "min")
+      token.type = ExprTokenType::MIN;
+    else if (ident == "max")
+      token.type = ExprTokenType::MAX;
+    else if (ident == "size")
+      token.type = ExprTokenType::SIZE;
+  }
+
   std::vector<ExprToken> tokens;
   std::string input;
   int pos;
@@ -0,0 +1,118 @@
+#pragma once
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+#ifdef _WIN32
+#include <fstream>
+#include <iostream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// The contents of an input file. Regular files are memory-mapped read-only so
+// they can be parsed in place; pipes and stdin (`-`) are read into a buffer.
+struct InputFile {
+  InputFile() = default;
+  InputFile(const InputFile &) = delete;
+  InputFile &operator=(const InputFile &) = delete;
+  ~InputFile() { close(); }
+
+  std::string_view data() const {
+    if (mapped)
+      return {mapped, mappedSize};
+    return buffer;
+  }
+
+  bool isMapped() const { return mapped != nullptr; }
+
+#ifdef _WIN32
+  bool open(const std::string &path) {
+    close();
+    if (path == "-") {
+      readStream(std::cin);
+      return true;
+    }
+    std::ifstream file(path, std::ios::binary);
+    if (file.fail())
+      return false;
+    readStream(file);
+    return true;
+  }
+
+  void readStream(std::istream &in) {
+    char chunk[1 << 16];
+    while (in.read(chunk, sizeof(chunk)) || in.gcount())
+      buffer.append(chunk, in.gcount());
+  }
+
+  void close() { buffer.clear(); }
+#else
+  bool open(const std::string &path) {
+    close();
+    int fd = path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0;
+    if (ok) {
+      bool regular = S_ISREG(info.st_mode) && info.st_size > 0;
+      ok = (regular && map(fd, info.st_size)) || readAll(fd);
+    }
+    if (fd != STDIN_FILENO)
+      ::close(fd);
+    return ok;
+  }
+
+  bool map(int fd, size_t size) {
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+      return false;
+    // Hints only, so failures are ignored
+    madvise(addr, size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(addr, size, MADV_HUGEPAGE);
+#endif
+    mapped = static_cast<const char *>(addr);
+    mappedSize = size;
+    return true;
+  }
+
+  bool readAll(int fd) {
+    size_t size = 0;
+    buffer.resize(1 << 16);
+    while (true) {
+      if (size == buffer.size())
+        buffer.resize(buffer.size() * 2);
+      ssize_t n = read(fd, buffer.data() + size, buffer.size() - size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0) {
+        buffer.clear();
+        return false;
+      }
+      if (n == 0)
+        break;
+      size += n;
+    }
+    buffer.resize(size);
+    return true;
+  }
+
+  void close() {
+    if (mapped)
+      munmap(const_cast<char *>(mapped), mappedSize);
+    mapped = nullptr;
+    mappedSize = 0;
+    buffer.clear();
+  }
+#endif
+
+  const char *mapped = nullptr;
+  size_t mappedSize = 0;
+  std::string buffer;
+};
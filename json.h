@@ -1,11 +1,17 @@
 #pragma once
+#include <cstdint>
 #include <memory>
-#include <sstream>
 #include <stdexcept>
 #include <string>
-#include <unordered_map>
+#include <string_view>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "jsonWriter.h"
+#include "keyTable.h"
+#include "simd.h"
+
 struct InvalidOperation : std::runtime_error {
   inline InvalidOperation(const std::string &key) : std::runtime_error(key) {}
 };
@@ -14,23 +20,45 @@ using Json = std::shared_ptr<struct JsonValue>;
 
 struct JsonValue {
   virtual ~JsonValue() = default;
-  virtual std::string toString() = 0;
+  inline virtual std::string toString() {
+    std::string out;
+    JsonWriter writer(out);
+    write(writer);
+    return out;
+  }
+  virtual void write(JsonWriter &out) = 0;
   virtual double getNumber() = 0;
-  virtual int getInt() = 0;
-  virtual Json &getIndex(int index) = 0;
+  virtual int64_t getInt() = 0;
+  virtual Json getIndex(int64_t index) = 0;
   virtual Json &getKey(const std::string &key) = 0;
+  // As `getKey`, but objects resolve the key to an ID through `cache`
+  inline virtual Json &getKeyCached(std::string_view key, const KeyCache &) {
+    return getKey(std::string(key));
+  }
+  // As `getKeyCached` and `getIndex`, but nullptr instead of throwing if
+  // there is no such member or element, or this is not an object or array
+  inline virtual Json *findKey(std::string_view, const KeyCache &) {
+    return nullptr;
+  }
+  inline virtual Json findIndex(int64_t) { return nullptr; }
   virtual int size() = 0;
+  inline virtual Json min() {
+    throw InvalidOperation("Can only take min/max of array");
+  }
+  inline virtual Json max() {
+    throw InvalidOperation("Can only take min/max of array");
+  }
 };
 
 struct JsonNull : JsonValue {
-  inline virtual std::string toString() { return "null"; }
+  inline virtual void write(JsonWriter &out) { out.null(); }
   inline virtual double getNumber() {
     throw InvalidOperation("Cannot treat null as number");
   };
-  inline virtual int getInt() {
+  inline virtual int64_t getInt() {
     throw InvalidOperation("Cannot treat null as int");
   };
-  inline virtual Json &getIndex(int index) {
+  inline virtual Json getIndex(int64_t) {
     throw InvalidOperation("Cannot index null");
   };
   inline virtual Json &getKey(const std::string &key) {
@@ -43,14 +71,14 @@ struct JsonNull : JsonValue {
 
 struct JsonBool : JsonValue {
   inline JsonBool(bool val) : val(val) {}
-  inline virtual std::string toString() { return val ? "true" : "false"; }
+  inline virtual void write(JsonWriter &out) { out.boolean(val); }
   inline virtual double getNumber() {
     throw InvalidOperation("Cannot treat bool as number");
   };
-  inline virtual int getInt() {
+  inline virtual int64_t getInt() {
     throw InvalidOperation("Cannot treat bool as int");
   }
-  inline virtual Json &getIndex(int index) {
+  inline virtual Json getIndex(int64_t) {
     throw InvalidOperation("Cannot index bool");
   };
   inline virtual Json &getKey(const std::string &key) {
@@ -63,11 +91,11 @@ struct JsonBool : JsonValue {
 };
 
 struct JsonInt : JsonValue {
-  inline JsonInt(int val) : val(val) {}
-  inline virtual std::string toString() { return std::to_string(val); }
+  inline JsonInt(int64_t val) : val(val) {}
+  inline virtual void write(JsonWriter &out) { out.integer(val); }
   inline virtual double getNumber() { return val; };
-  inline virtual int getInt() { return val; }
-  inline virtual Json &getIndex(int index) {
+  inline virtual int64_t getInt() { return val; }
+  inline virtual Json getIndex(int64_t) {
     throw InvalidOperation("Cannot index int");
   };
   inline virtual Json &getKey(const std::string &key) {
@@ -76,17 +104,17 @@ struct JsonInt : JsonValue {
   inline virtual int size() {
     throw InvalidOperation("Cannot take size of int");
   };
-  int val;
+  int64_t val;
 };
 
 struct JsonNumber : JsonValue {
   inline JsonNumber(double val) : val(val) {}
-  inline virtual std::string toString() { return std::to_string(val); }
+  inline virtual void write(JsonWriter &out) { out.number(val); }
   inline virtual double getNumber() { return val; };
-  inline virtual int getInt() {
+  inline virtual int64_t getInt() {
     throw InvalidOperation("Cannot treat double as int");
   }
-  inline virtual Json &getIndex(int index) {
+  inline virtual Json getIndex(int64_t) {
     throw InvalidOperation("Cannot index number");
   };
   inline virtual Json &getKey(const std::string &key) {
@@ -100,14 +128,14 @@ struct JsonNumber : JsonValue {
 
 struct JsonString : JsonValue {
   inline JsonString(const std::string &val) : val(val) {}
-  inline virtual std::string toString() { return '"' + val + '"'; }
+  inline virtual void write(JsonWriter &out) { out.string(val); }
   inline virtual double getNumber() {
     throw InvalidOperation("Cannot treat string as number");
   };
-  inline virtual int getInt() {
+  inline virtual int64_t getInt() {
     throw InvalidOperation("Cannot treat string as int");
   }
-  inline virtual Json &getIndex(int index) {
+  inline virtual Json getIndex(int64_t) {
     throw InvalidOperation("Cannot index string");
   };
   inline virtual Json &getKey(const std::string &key) {
@@ -118,20 +146,13 @@ struct JsonString : JsonValue {
 };
 
 struct JsonArray : JsonValue {
-  inline virtual std::string toString() {
-    std::stringstream ss;
-    ss << "[";
-    bool first = true;
-    for (auto &val : arr) {
-      if (!first)
-        ss << ", ";
-      first = false;
-      ss << val->toString();
-    }
-    ss << "]";
-    return ss.str();
+  inline virtual void write(JsonWriter &out) {
+    out.beginArray();
+    for (auto &val : arr)
+      val->write(out);
+    out.endArray();
   }
-  inline Json min() {
+  inline virtual Json min() {
     if (arr.size() == 0) {
       throw InvalidOperation("Min called on empty array");
     }
@@ -146,7 +167,7 @@ struct JsonArray : JsonValue {
     }
     return arr[index];
   }
-  inline Json max() {
+  inline virtual Json max() {
     if (arr.size() == 0) {
       throw InvalidOperation("Min called on empty array");
     }
@@ -165,16 +186,21 @@ struct JsonArray : JsonValue {
   inline virtual double getNumber() {
     throw InvalidOperation("Cannot treat array as number");
   };
-  inline virtual int getInt() {
+  inline virtual int64_t getInt() {
     throw InvalidOperation("Cannot treat array as int");
   }
-  inline virtual Json &getIndex(int index) {
-    if (index < 0 || index > arr.size()) {
+  inline virtual Json getIndex(int64_t index) {
+    if (index < 0 || size_t(index) >= arr.size()) {
       throw InvalidOperation("Invalid index to array: " +
                              std::to_string(index));
     }
     return arr[index];
   };
+  inline virtual Json findIndex(int64_t index) {
+    if (index < 0 || size_t(index) >= arr.size())
+      return nullptr;
+    return arr[index];
+  }
   inline virtual Json &getKey(const std::string &key) {
     throw InvalidOperation("Cannot index array by key");
   };
@@ -182,37 +208,166 @@ struct JsonArray : JsonValue {
   std::vector<Json> arr;
 };
 
+// An array of only integers (`JsonInt`) or only doubles (`JsonNumber`), stored
+// unboxed so min and max are vectorised reductions. Elements are boxed again
+// when indexed.
+template <class T, class Element> struct JsonPackedArray : JsonValue {
+  inline JsonPackedArray(std::vector<T> vals) : vals(std::move(vals)) {}
+
+  inline virtual void write(JsonWriter &out) {
+    out.beginArray();
+    for (T val : vals) {
+      if constexpr (std::is_same_v<T, int64_t>)
+        out.integer(val);
+      else
+        out.number(val);
+    }
+    out.endArray();
+  }
+  inline virtual double getNumber() {
+    throw InvalidOperation("Cannot treat array as number");
+  };
+  inline virtual int64_t getInt() {
+    throw InvalidOperation("Cannot treat array as int");
+  }
+  inline virtual Json getIndex(int64_t index) {
+    if (index < 0 || size_t(index) >= vals.size()) {
+      throw InvalidOperation("Invalid index to array: " +
+                             std::to_string(index));
+    }
+    return std::make_shared<Element>(vals[index]);
+  };
+  inline virtual Json findIndex(int64_t index) {
+    if (index < 0 || size_t(index) >= vals.size())
+      return nullptr;
+    return std::make_shared<Element>(vals[index]);
+  }
+  inline virtual Json &getKey(const std::string &) {
+    throw InvalidOperation("Cannot index array by key");
+  };
+  inline virtual int size() { return vals.size(); };
+  inline virtual Json min() { return reduce(true); }
+  inline virtual Json max() { return reduce(false); }
+
+  // Never empty, as empty arrays are parsed as `JsonArray`
+  inline Json reduce(bool isMin) {
+    if constexpr (std::is_same_v<T, int64_t>)
+      return std::make_shared<Element>(
+          reduceInt(vals.data(), vals.size(), isMin));
+    else
+      return std::make_shared<Element>(
+          reduceDouble(vals.data(), vals.size(), isMin));
+  }
+
+  std::vector<T> vals;
+};
+
+using JsonIntArray = JsonPackedArray<int64_t, JsonInt>;
+using JsonDoubleArray = JsonPackedArray<double, JsonNumber>;
+
+// Members are kept in document order in one flat vector, and refer to their
+// keys by ID in the document's `KeyTable`. Small objects are searched
+// linearly; larger ones also get an open-addressing index of member positions.
 struct JsonObject : JsonValue {
-  inline virtual std::string toString() {
-    std::stringstream ss;
-    ss << "{";
-    bool first = true;
-    for (auto &[key, val] : mapping) {
-      if (!first) {
-        ss << ", ";
-      }
-      first = false;
-      ss << '"' << key << "\": " << val->toString();
+  inline JsonObject() : keys(std::make_shared<KeyTable>()) {}
+  inline JsonObject(std::shared_ptr<KeyTable> keys) : keys(std::move(keys)) {}
+
+  inline virtual void write(JsonWriter &out) {
+    out.beginObject();
+    for (auto &[id, val] : members) {
+      out.key(keys->name(id));
+      val->write(out);
     }
-    ss << "}";
-    return ss.str();
+    out.endObject();
   }
   inline virtual double getNumber() {
     throw InvalidOperation("Cannot treat object as number");
   };
-  inline virtual int getInt() {
+  inline virtual int64_t getInt() {
     throw InvalidOperation("Cannot treat object as int");
   }
-  inline virtual Json &getIndex(int index) {
+  inline virtual Json getIndex(int64_t) {
     throw InvalidOperation("Cannot index object by int");
   };
   inline virtual Json &getKey(const std::string &key) {
-    if (auto it = mapping.find(key); it != mapping.end()) {
-      return it->second;
+    if (Json *val = find(keys->find(key)))
+      return *val;
+    throw InvalidOperation("Key not in object: " + key);
+  };
+  inline virtual Json &getKeyCached(std::string_view key,
+                                    const KeyCache &cache) {
+    if (Json *val = findKey(key, cache))
+      return *val;
+    throw InvalidOperation("Key not in object: " + std::string(key));
+  }
+  inline virtual Json *findKey(std::string_view key, const KeyCache &cache) {
+    return find(cache.resolve(*keys, key));
+  }
+  inline virtual int size() { return members.size(); };
+
+  inline Json *find(uint32_t id) {
+    if (index.empty()) {
+      for (auto &[key, val] : members) {
+        if (key == id)
+          return &val;
+      }
+      return nullptr;
+    }
+    size_t mask = index.size() - 1;
+    for (size_t i = slotOf(id, mask);; i = (i + 1) & mask) {
+      uint32_t slot = index[i];
+      if (slot == 0)
+        return nullptr;
+      if (members[slot - 1].first == id)
+        return &members[slot - 1].second;
+    }
+  }
+
+  inline void set(std::string_view key, Json val) {
+    set(keys->intern(key), std::move(val));
+  }
+
+  // A repeated key replaces the earlier value but keeps its position
+  inline void set(uint32_t id, Json val) {
+    if (Json *existing = find(id)) {
+      *existing = std::move(val);
+      return;
+    }
+    members.emplace_back(id, std::move(val));
+    if (members.size() * 2 > index.size()) {
+      if (members.size() > indexThreshold)
+        reindex();
     } else {
-      throw InvalidOperation("Key not in object: " + key);
+      addToIndex(members.size() - 1);
     }
-  };
-  inline virtual int size() { return mapping.size(); };
-  std::unordered_map<std::string, Json> mapping;
+  }
+
+  // Kept at most half full
+  inline void reindex() {
+    size_t slots = 64;
+    while (slots < members.size() * 4)
+      slots *= 2;
+    index.assign(slots, 0);
+    for (uint32_t m = 0; m < members.size(); m++)
+      addToIndex(m);
+  }
+
+  inline void addToIndex(uint32_t member) {
+    size_t mask = index.size() - 1;
+    size_t i = slotOf(members[member].first, mask);
+    while (index[i])
+      i = (i + 1) & mask;
+    index[i] = member + 1;
+  }
+
+  inline static size_t slotOf(uint32_t id, size_t mask) {
+    return (id * 0x9E3779B97F4A7C15ull >> 32) & mask;
+  }
+
+  inline static constexpr size_t indexThreshold = 16;
+  std::shared_ptr<KeyTable> keys;
+  std::vector<std::pair<uint32_t, Json>> members;
+  // Member position + 1 by key ID, 0 if empty. Only built above
+  // `indexThreshold` members.
+  std::vector<uint32_t> index;
 };
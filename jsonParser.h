@@ -1,113 +1,275 @@
 #pragma once
 #include <format>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <string_view>
 
 #include "json.h"
+#include "keyTable.h"
 #include "jsonTokeniser.h"
+#include "projection.h"
+#include "stats.h"
 
 struct JsonParser {
-  Json parse(const std::string &input_) {
-    input = input_;
-    tokeniser.tokenise(input);
+  // `input_` is only referenced while parsing, never copied
+  Json parse(std::string_view input_) {
+    projection = nullptr;
+    return parseDocument(input_);
+  }
+
+  // Only builds the parts of the document in `projection_`. Everything else is
+  // skipped by bracket matching, so it is not validated either.
+  Json parse(std::string_view input_, const JsonProjection &projection_) {
+    projection = &projection_;
+    return parseDocument(input_);
+  }
 
-    pos = 0;
+  Json parseDocument(std::string_view input_) {
+    reset(input_);
     Json expr = parseHelper();
-    if (tokeniser.tokens[pos].type != JsonTokenType::EOF_) {
+    if (token.type != JsonTokenType::EOF_) {
       throw JsonParseError("Unexpected token");
     }
+    counts.flush();
     return expr;
   }
 
+  // Parses `input_` as the elements of an array without its brackets, such as
+  // one run of a large array split up by `ParallelParser`
+  Json parseRun(std::string_view input_) {
+    projection = nullptr;
+    reset(input_);
+    Json run = parseArray(JsonTokenType::EOF_);
+    counts.flush();
+    return run;
+  }
+
+  void reset(std::string_view input_) {
+    if (!reuseKeys || !keys || keys->size() > maxReusedKeys)
+      keys = std::make_shared<KeyTable>();
+    input = input_;
+    tokeniser.reset(input);
+    advance();
+  }
+
+  // Consumes the lookahead token and lexes the next one
+  JsonToken advance() {
+    JsonToken current = token;
+    token = tokeniser.next();
+    counts.token();
+    return current;
+  }
+
+  // Skips the value starting at the lookahead token without building it
+  void skipValue() {
+    switch (token.type) {
+    case JsonTokenType::LEFT_SQUARE:
+    case JsonTokenType::LEFT_CURLY:
+      tokeniser.skipContainer();
+      break;
+    case JsonTokenType::TRUE:
+    case JsonTokenType::FALSE:
+    case JsonTokenType::NULL_:
+    case JsonTokenType::INT:
+    case JsonTokenType::NUMBER:
+    case JsonTokenType::STRING:
+      break;
+    default:
+      // Reports the same error as a full parse
+      parseHelper();
+    }
+    advance();
+  }
+
+  // Stands in for skipped array elements, so later elements keep their index
+  inline static const Json &skippedValue() {
+    static const Json skipped = std::make_shared<JsonNull>();
+    return skipped;
+  }
+
   Json parseHelper() {
-    while (pos < tokeniser.tokens.size()) {
-      auto [type, start, end] = tokeniser.tokens[pos++];
-      switch (type) {
-      case JsonTokenType::TRUE:
-        return std::make_shared<JsonBool>(true);
-
-      case JsonTokenType::FALSE:
-        return std::make_shared<JsonBool>(false);
-
-      case JsonTokenType::NULL_:
-        return std::make_shared<JsonNull>();
-
-      case JsonTokenType::INT:
-        return std::make_shared<JsonInt>(
-            std::stoi(input.substr(start, end - start + 1)));
-
-      case JsonTokenType::NUMBER:
-        return std::make_shared<JsonNumber>(
-            std::stod(input.substr(start, end - start + 1)));
-
-      case JsonTokenType::STRING:
-        return std::make_shared<JsonString>(
-            input.substr(start + 1, end - start - 1));
-
-      case JsonTokenType::LEFT_SQUARE: {
-        auto jsonArray = std::make_shared<JsonArray>();
-        parseArray(jsonArray->arr);
-        return jsonArray;
-      }
+    const JsonProjection *current = projection;
+    if (current && current->whole)
+      projection = nullptr;
+    Json val = parseValue();
+    projection = current;
+    return val;
+  }
 
-      case JsonTokenType::RIGHT_SQUARE:
-        throw JsonParseError("Unexpected closing list bracket");
+  Json parseValue() {
+    auto [type, start, end] = advance();
+    counts.value(type);
+    switch (type) {
+    case JsonTokenType::TRUE:
+      return std::make_shared<JsonBool>(true);
 
-      case JsonTokenType::LEFT_CURLY: {
-        auto jsonObj = std::make_shared<JsonObject>();
-        parseObject(jsonObj->mapping);
-        return jsonObj;
-      }
+    case JsonTokenType::FALSE:
+      return std::make_shared<JsonBool>(false);
 
-      case JsonTokenType::RIGHT_CURLY:
-        throw JsonParseError("Unexpected closing object bracket");
+    case JsonTokenType::NULL_:
+      return std::make_shared<JsonNull>();
 
-      case JsonTokenType::COMMA:
-        throw JsonParseError("Unexpected comma");
+    case JsonTokenType::INT: {
+      std::string_view text = input.substr(start, end - start + 1);
+      int64_t val;
+      if (decodeInt(text, val))
+        return std::make_shared<JsonInt>(val);
+      return std::make_shared<JsonNumber>(decodeDouble(text));
+    }
 
-      case JsonTokenType::COLON:
-        throw JsonParseError("Unexpected colon");
+    case JsonTokenType::NUMBER:
+      return std::make_shared<JsonNumber>(
+          decodeDouble(input.substr(start, end - start + 1)));
 
-      case JsonTokenType::EOF_:
-        throw JsonParseError("Unexpected end of file");
-      }
+    case JsonTokenType::STRING: {
+      auto str = std::make_shared<JsonString>("");
+      decodeString(input.substr(start + 1, end - start - 1), str->val);
+      return str;
+    }
+
+    case JsonTokenType::LEFT_SQUARE:
+      return parseArray();
+
+    case JsonTokenType::RIGHT_SQUARE:
+      throw JsonParseError("Unexpected closing list bracket");
+
+    case JsonTokenType::LEFT_CURLY: {
+      auto jsonObj = std::make_shared<JsonObject>(keys);
+      parseObject(*jsonObj);
+      return jsonObj;
+    }
+
+    case JsonTokenType::RIGHT_CURLY:
+      throw JsonParseError("Unexpected closing object bracket");
+
+    case JsonTokenType::COMMA:
+      throw JsonParseError("Unexpected comma");
+
+    case JsonTokenType::COLON:
+      throw JsonParseError("Unexpected colon");
+
+    case JsonTokenType::EOF_:
+      throw JsonParseError("Unexpected end of file");
     }
     throw; // Unreachable
   }
 
-  void parseArray(std::vector<Json> &arr) {
-    if (tokeniser.tokens.back().type == JsonTokenType::RIGHT_SQUARE)
-      return;
+  // `closing` ends the array: its bracket, or the end of a run
+  Json parseArray(JsonTokenType closing = JsonTokenType::RIGHT_SQUARE) {
+    auto jsonArray = std::make_shared<JsonArray>();
+    if (token.type == closing) {
+      advance();
+      return jsonArray;
+    }
+    bool numeric = token.type == JsonTokenType::INT ||
+                   token.type == JsonTokenType::NUMBER;
+    if (numeric && !projection) {
+      if (Json packed = parseNumbers(jsonArray->arr, closing))
+        return packed;
+    }
+    parseElements(jsonArray->arr, closing);
+    return jsonArray;
+  }
+
+  // Packs an array of only integers or only doubles. Otherwise returns nullptr
+  // at the first element of another kind, with the elements before it boxed
+  // into `arr`.
+  Json parseNumbers(std::vector<Json> &arr, JsonTokenType closing) {
+    JsonTokenType type = token.type;
+    ints.clear();
+    doubles.clear();
+    while (true) {
+      std::string_view text =
+          input.substr(token.start, token.end - token.start + 1);
+      int64_t val;
+      if (token.type != type || (type == JsonTokenType::INT &&
+                                 !decodeInt(text, val)))
+        break;
+      if (type == JsonTokenType::INT)
+        ints.push_back(val);
+      else
+        doubles.push_back(decodeDouble(text));
+      counts.value(type);
+      advance();
 
+      auto separator = advance().type;
+      if (separator == closing) {
+        if (type == JsonTokenType::INT)
+          return std::make_shared<JsonIntArray>(ints);
+        return std::make_shared<JsonDoubleArray>(doubles);
+      }
+      if (separator != JsonTokenType::COMMA)
+        throw JsonParseError("Comma expected between elements of array");
+    }
+    for (int64_t val : ints)
+      arr.push_back(std::make_shared<JsonInt>(val));
+    for (double val : doubles)
+      arr.push_back(std::make_shared<JsonNumber>(val));
+    return nullptr;
+  }
+
+  // Parses the remaining elements, from the lookahead token on
+  void parseElements(std::vector<Json> &arr, JsonTokenType closing) {
     // Trailing commas not allowed
-    while (pos < tokeniser.tokens.size()) {
-      arr.push_back(parseHelper());
-      auto type = tokeniser.tokens[pos++].type;
-      if (type == JsonTokenType::RIGHT_SQUARE)
+    const JsonProjection *current = projection;
+    for (int i = arr.size();; i++) {
+      if (current) {
+        projection = current->element(i);
+        if (projection) {
+          arr.push_back(parseHelper());
+        } else {
+          skipValue();
+          arr.push_back(skippedValue());
+        }
+        projection = current;
+      } else {
+        arr.push_back(parseHelper());
+      }
+      auto type = advance().type;
+      if (type == closing)
         return;
       if (type != JsonTokenType::COMMA)
         throw JsonParseError("Comma expected between elements of array");
     }
   }
 
-  void parseObject(std::unordered_map<std::string, Json> &map) {
-    if (tokeniser.tokens.back().type == JsonTokenType::RIGHT_CURLY)
+  void parseObject(JsonObject &obj) {
+    if (token.type == JsonTokenType::RIGHT_CURLY) {
+      advance();
       return;
+    }
 
     // Trailing commas not allowed
-    while (pos < tokeniser.tokens.size()) {
-      auto type = tokeniser.tokens[pos].type;
+    while (true) {
+      auto [type, start, end] = advance();
       if (type != JsonTokenType::STRING)
         throw JsonParseError("Expected string key");
 
-      auto key = std::dynamic_pointer_cast<JsonString>(parseHelper())->val;
+      // Only keys with escapes need decoding into a buffer first
+      std::string_view key = input.substr(start + 1, end - start - 1);
+      if (key.find('\\') != std::string_view::npos) {
+        keyBuffer.clear();
+        decodeString(key, keyBuffer);
+        key = keyBuffer;
+      }
+      uint32_t id = keys->intern(key);
 
-      if (tokeniser.tokens[pos++].type != JsonTokenType::COLON)
+      if (advance().type != JsonTokenType::COLON)
         throw JsonParseError("Colon expected after key in object");
 
-      map[key] = parseHelper();
+      if (const JsonProjection *current = projection) {
+        projection = current->member(key);
+        if (projection)
+          obj.set(id, parseHelper());
+        else
+          skipValue();
+        projection = current;
+      } else {
+        obj.set(id, parseHelper());
+      }
 
-      auto type2 = tokeniser.tokens[pos++].type;
+      auto type2 = advance().type;
       if (type2 == JsonTokenType::RIGHT_CURLY)
         return;
       if (type2 != JsonTokenType::COMMA)
@@ -115,7 +277,23 @@ struct JsonParser {
     }
   }
 
-  std::string input;
-  int pos;
+  std::string_view input;
+  JsonToken token;
   JsonTokeniser tokeniser;
+  // Keys of the document being parsed
+  std::shared_ptr<KeyTable> keys;
+  std::string keyBuffer;
+  // Numeric arrays being packed
+  std::vector<int64_t> ints;
+  std::vector<double> doubles;
+  ParseCounts counts;
+  // Keeps one key table for every document parsed, e.g. for NDJSON records
+  // with the same fields. Documents that are still alive must not be read
+  // from other threads while another is being parsed. A fresh table is
+  // started once it holds `maxReusedKeys`, in case keys are not repeated.
+  bool reuseKeys = false;
+  size_t maxReusedKeys = 1 << 16;
+  // What still needs building below the value being parsed, or nullptr when
+  // everything does
+  const JsonProjection *projection = nullptr;
 };
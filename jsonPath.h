@@ -0,0 +1,157 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+
+#include "document.h"
+#include "exprTokeniser.h"
+#include "json.h"
+#include "keyTable.h"
+
+// Paths fixed at build time, such as `a.b[2].c`, parsed by the compiler.
+// `jsonPath<"a.b[2].c">(doc)` gives what `evaluate` would, but nothing is
+// tokenised or parsed at runtime, and the keys' hashes are constants. A
+// malformed path is a compile error at the `ExprParseError` it would have
+// thrown.
+//
+// Only keys and integer subscripts are accepted; anything else, such as
+// `max(...)` or a computed subscript, goes through `compileExpr`.
+
+template <size_t N> struct FixedString {
+  consteval FixedString(const char (&str)[N]) { std::copy_n(str, N, text); }
+  constexpr std::string_view view() const { return {text, N - 1}; }
+  char text[N];
+};
+
+struct PathStep {
+  // Otherwise an index
+  bool isKey = false;
+  std::string_view key;
+  uint64_t hash = 0;
+  int64_t index = 0;
+};
+
+// As `ExprTokeniser` and `ExprParser` read a path. Returns the number of
+// steps, and writes them to `steps` if given.
+constexpr size_t parsePath(std::string_view path, PathStep *steps = nullptr) {
+  auto isDigit = [](char c) { return c >= '0' && c <= '9'; };
+  auto isAlpha = [](char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+  };
+  size_t pos = 0, count = 0;
+  auto skipSpace = [&] {
+    while (pos < path.size() && (path[pos] == ' ' || path[pos] == '\t' ||
+                                 path[pos] == '\n' || path[pos] == '\r'))
+      pos++;
+  };
+  auto add = [&](PathStep step) {
+    if (steps)
+      steps[count] = step;
+    count++;
+  };
+  auto key = [&] {
+    size_t start = pos;
+    while (pos < path.size() &&
+           (isAlpha(path[pos]) || isDigit(path[pos]) || path[pos] == '_'))
+      pos++;
+    std::string_view name = path.substr(start, pos - start);
+    if (name == "min" || name == "max" || name == "size")
+      throw ExprParseError("Only keys and integer subscripts in a static "
+                           "path");
+    add({true, name, fnv1a(name), 0});
+  };
+  auto index = [&] {
+    skipSpace();
+    bool negative = pos < path.size() && path[pos] == '-';
+    if (negative)
+      pos++;
+    size_t start = pos;
+    int64_t val = 0;
+    while (pos < path.size() && isDigit(path[pos])) {
+      if (pos - start == 18)
+        throw ExprParseError("Subscript out of range");
+      val = val * 10 + (path[pos++] - '0');
+    }
+    if (pos == start) {
+      throw ExprParseError(negative ? "Expected digit in number"
+                                    : "Only keys and integer subscripts in a "
+                                      "static path");
+    }
+    skipSpace();
+    if (pos == path.size() || path[pos] != ']')
+      throw ExprParseError("Expected closing bracket for subscript");
+    pos++;
+    add({false, {}, 0, negative ? -val : val});
+  };
+
+  skipSpace();
+  if (pos == path.size())
+    throw ExprParseError("Empty expression");
+  if (isAlpha(path[pos]))
+    key();
+  else if (path[pos] != '[')
+    throw ExprParseError("Only keys and integer subscripts in a static path");
+  while (true) {
+    skipSpace();
+    if (pos == path.size())
+      return count;
+    if (path[pos] == '[') {
+      pos++;
+      index();
+    } else if (path[pos] == '.') {
+      pos++;
+      skipSpace();
+      if (pos == path.size() || !isAlpha(path[pos]))
+        throw ExprParseError("Expected identifier after dot");
+      key();
+    } else {
+      throw ExprParseError("Unexpected token");
+    }
+  }
+}
+
+template <FixedString Path> struct JsonPath {
+  inline static constexpr size_t length = parsePath(Path.view());
+  inline static constexpr std::array<PathStep, length> steps = [] {
+    std::array<PathStep, length> steps;
+    parsePath(Path.view(), steps.data());
+    return steps;
+  }();
+  // One per key, as each expression node has
+  template <size_t I> inline static KeyCache keyCache{steps[I].hash};
+
+  Json operator()(const Json &root) const {
+    return walk(root, std::make_index_sequence<length>());
+  }
+
+  JsonNode operator()(const JsonNode &root) const {
+    return walk(root, std::make_index_sequence<length>());
+  }
+
+  JsonNode operator()(const Document &doc) const { return (*this)(doc.root); }
+
+  template <class Value, size_t... I>
+  static Value walk(Value val, std::index_sequence<I...>) {
+    ((val = step<I>(val)), ...);
+    return val;
+  }
+
+  template <size_t I> static Json step(const Json &val) {
+    if constexpr (steps[I].isKey)
+      return val->getKeyCached(steps[I].key, keyCache<I>);
+    else
+      return val->getIndex(steps[I].index);
+  }
+
+  template <size_t I> static JsonNode step(const JsonNode &val) {
+    if constexpr (steps[I].isKey)
+      return val.getKey(steps[I].key);
+    else
+      return val.getIndex(steps[I].index);
+  }
+};
+
+template <FixedString Path> inline constexpr JsonPath<Path> jsonPath{};
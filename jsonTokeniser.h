@@ -1,10 +1,16 @@
 #pragma once
 
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
 #include <format>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "simd.h"
+
 enum class JsonTokenType {
   TRUE,
   FALSE,
@@ -23,8 +29,8 @@ enum class JsonTokenType {
 
 struct JsonToken {
   JsonTokenType type;
-  int start;
-  int end;
+  size_t start;
+  size_t end;
 };
 
 inline std::string p(JsonTokenType t) {
@@ -62,127 +68,339 @@ struct JsonParseError : std::runtime_error {
   inline JsonParseError(const std::string &key) : std::runtime_error(key) {}
 };
 
+inline unsigned decodeHex4(std::string_view raw, size_t pos) {
+  if (pos + 4 > raw.size())
+    throw JsonParseError("Invalid unicode escape");
+  unsigned val = 0;
+  for (size_t i = pos; i < pos + 4; i++) {
+    char c = raw[i];
+    val <<= 4;
+    if (c >= '0' && c <= '9')
+      val |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      val |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      val |= c - 'A' + 10;
+    else
+      throw JsonParseError("Invalid unicode escape");
+  }
+  return val;
+}
+
+inline void appendUtf8(std::string &out, unsigned codepoint) {
+  if (codepoint < 0x80) {
+    out += char(codepoint);
+  } else if (codepoint < 0x800) {
+    out += char(0xC0 | (codepoint >> 6));
+    out += char(0x80 | (codepoint & 0x3F));
+  } else if (codepoint < 0x10000) {
+    out += char(0xE0 | (codepoint >> 12));
+    out += char(0x80 | ((codepoint >> 6) & 0x3F));
+    out += char(0x80 | (codepoint & 0x3F));
+  } else {
+    out += char(0xF0 | (codepoint >> 18));
+    out += char(0x80 | ((codepoint >> 12) & 0x3F));
+    out += char(0x80 | ((codepoint >> 6) & 0x3F));
+    out += char(0x80 | (codepoint & 0x3F));
+  }
+}
+
+// Appends the contents of a string token (without its quotes) to `out`,
+// resolving escape sequences
+inline void decodeString(std::string_view raw, std::string &out) {
+  size_t pos = 0;
+  while (true) {
+    size_t escape = raw.find('\\', pos);
+    out.append(raw.substr(pos, escape - pos));
+    if (escape == std::string_view::npos)
+      return;
+    pos = escape + 2;
+    if (pos > raw.size())
+      throw JsonParseError("Invalid escape");
+    switch (raw[escape + 1]) {
+    case '"':
+    case '\\':
+    case '/':
+      out += raw[escape + 1];
+      break;
+    case 'b':
+      out += '\b';
+      break;
+    case 'f':
+      out += '\f';
+      break;
+    case 'n':
+      out += '\n';
+      break;
+    case 'r':
+      out += '\r';
+      break;
+    case 't':
+      out += '\t';
+      break;
+    case 'u': {
+      unsigned codepoint = decodeHex4(raw, pos);
+      pos += 4;
+      // Characters outside the BMP are written as a surrogate pair
+      if (codepoint >= 0xD800 && codepoint < 0xDC00 &&
+          raw.substr(pos, 2) == "\\u") {
+        unsigned low = decodeHex4(raw, pos + 2);
+        if (low >= 0xDC00 && low < 0xE000) {
+          codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+          pos += 6;
+        }
+      }
+      appendUtf8(out, codepoint);
+      break;
+    }
+    default:
+      throw JsonParseError("Invalid escape");
+    }
+  }
+}
+
+// Decodes an integer token in place. Returns false if it does not fit in 64
+// bits, in which case it should be read as a double instead.
+inline bool decodeInt(std::string_view text, int64_t &out) {
+  bool negative = text[0] == '-';
+  // Up to 18 digits cannot overflow
+  if (text.size() - negative <= 18) {
+    uint64_t val = 0;
+    for (size_t i = negative; i < text.size(); i++)
+      val = val * 10 + (text[i] - '0');
+    out = negative ? -int64_t(val) : int64_t(val);
+    return true;
+  }
+  auto [end, error] = std::from_chars(text.data(), text.data() + text.size(),
+                                      out);
+  return error == std::errc() && end == text.data() + text.size();
+}
+
+// Decodes a number token in place, to the nearest double
+inline double decodeDouble(std::string_view text) {
+  double val;
+  auto [end, error] = std::from_chars(text.data(), text.data() + text.size(),
+                                      val);
+  if (error == std::errc::result_out_of_range) {
+    // Overflows to infinity and underflows to zero, as strtod does
+    return std::strtod(std::string(text).c_str(), nullptr);
+  }
+  return val;
+}
+
+// Lexes one token at a time as the parser asks for it, so memory use does not
+// grow with the size of the document.
 struct JsonTokeniser {
-  void tokenise(const std::string &input_) {
+  // Tokens refer to `input_` by offset, so it must outlive them
+  void reset(std::string_view input_) {
     input = input_;
     pos = 0;
-    tokens.clear();
+  }
+
+  JsonToken next() {
     while (pos < input.size()) {
+      size_t start = pos;
       switch (input[pos]) {
       case '\t':
       case '\n':
       case '\r':
       case ' ':
-        pos++;
+        skipWhitespace();
         break;
 
       case 't':
         if (input.substr(pos, 4) != "true")
           throw JsonParseError("Invalid keyword");
-        tokens.emplace_back(JsonTokenType::TRUE, pos, pos + 3);
         pos += 4;
-        break;
+        return {JsonTokenType::TRUE, start, start + 3};
 
       case 'f':
         if (input.substr(pos, 5) != "false")
           throw JsonParseError("Invalid keyword");
-        tokens.emplace_back(JsonTokenType::FALSE, pos, pos + 4);
         pos += 5;
-        break;
+        return {JsonTokenType::FALSE, start, start + 4};
 
       case 'n':
         if (input.substr(pos, 4) != "null")
           throw JsonParseError("Invalid keyword");
-        tokens.emplace_back(JsonTokenType::NULL_, pos, pos + 3);
         pos += 4;
-        break;
+        return {JsonTokenType::NULL_, start, start + 3};
 
       case '[':
-        tokens.emplace_back(JsonTokenType::LEFT_SQUARE, pos, pos);
         pos++;
-        break;
+        return {JsonTokenType::LEFT_SQUARE, start, start};
 
       case ']':
-        tokens.emplace_back(JsonTokenType::RIGHT_SQUARE, pos, pos);
         pos++;
-        break;
+        return {JsonTokenType::RIGHT_SQUARE, start, start};
 
       case '{':
-        tokens.emplace_back(JsonTokenType::LEFT_CURLY, pos, pos);
         pos++;
-        break;
+        return {JsonTokenType::LEFT_CURLY, start, start};
 
       case '}':
-        tokens.emplace_back(JsonTokenType::RIGHT_CURLY, pos, pos);
         pos++;
-        break;
+        return {JsonTokenType::RIGHT_CURLY, start, start};
 
       case ':':
-        tokens.emplace_back(JsonTokenType::COLON, pos, pos);
         pos++;
-        break;
+        return {JsonTokenType::COLON, start, start};
 
       case ',':
-        tokens.emplace_back(JsonTokenType::COMMA, pos, pos);
         pos++;
-        break;
+        return {JsonTokenType::COMMA, start, start};
 
       case '"':
-        tokens.emplace_back(JsonTokenType::STRING, pos, 0);
         pos++;
         tokenString();
-        break;
+        return {JsonTokenType::STRING, start, pos - 1};
 
       default: {
         if (input[pos] == '-' || isdigit(input[pos])) {
-          tokens.emplace_back(JsonTokenType::INT, pos, pos);
           pos++;
-          tokenInt();
+          JsonTokenType type = tokenInt();
+          return {type, start, pos - 1};
         } else {
           throw JsonParseError(std::string("Unexpected character: ") +
                                input[pos]);
         }
-        break;
       }
       }
     }
+    return {JsonTokenType::EOF_, pos, pos};
+  }
 
-    tokens.push_back({JsonTokenType::EOF_, pos, pos});
+  // Lexes the whole input up front, for debugging and benchmarking the lexer
+  void tokenise(std::string_view input_) {
+    reset(input_);
+    tokens.clear();
+    do {
+      tokens.push_back(next());
+    } while (tokens.back().type != JsonTokenType::EOF_);
   }
 
+  // Digits, of which there must be at least one
   void tokenNum() {
-    while (pos < input.size()) {
-      if (!isdigit(input[pos]))
-        return;
-      tokens.back().end = pos++;
-    }
+    if (pos >= input.size() || !isdigit(input[pos]))
+      throw JsonParseError("Expected digit in number");
+    while (pos < input.size() && isdigit(input[pos]))
+      pos++;
   }
 
-  void tokenInt() {
-    while (pos < input.size()) {
-      if (input[pos] == '.') {
-        tokens.back().type = JsonTokenType::NUMBER;
+  // Lexes the rest of a number after its first character. Anything with a
+  // fraction or exponent is a NUMBER.
+  JsonTokenType tokenInt() {
+    if (input[pos - 1] == '-')
+      tokenNum();
+    while (pos < input.size() && isdigit(input[pos]))
+      pos++;
+    JsonTokenType type = JsonTokenType::INT;
+    if (pos < input.size() && input[pos] == '.') {
+      pos++;
+      tokenNum();
+      type = JsonTokenType::NUMBER;
+    }
+    if (pos < input.size() && (input[pos] == 'e' || input[pos] == 'E')) {
+      pos++;
+      if (pos < input.size() && (input[pos] == '+' || input[pos] == '-'))
         pos++;
-        tokenNum();
+      tokenNum();
+      type = JsonTokenType::NUMBER;
+    }
+    return type;
+  }
+
+  inline static bool isWhitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+  }
+
+  // Runs between tokens are usually a single space, so only longer ones are
+  // worth classifying 64 bytes at a time
+  void skipWhitespace() {
+    pos++;
+    if (pos < input.size() && !isWhitespace(input[pos]))
+      return;
+    while (pos + 64 <= input.size()) {
+      uint64_t other = ~classifyBlock(input.data() + pos).whitespace;
+      if (other) {
+        pos += lowestBit(other);
         return;
       }
-      if (!isdigit(input[pos]))
-        return;
-      tokens.back().end = pos++;
+      pos += 64;
     }
+    while (pos < input.size() && isWhitespace(input[pos]))
+      pos++;
   }
 
+  // Leaves `pos` just past the closing quote
   void tokenString() {
+    while (pos + 64 <= input.size()) {
+      BlockMasks masks = classifyBlock(input.data() + pos);
+      uint64_t special = masks.quote | masks.backslash;
+      if (!special) {
+        pos += 64;
+        continue;
+      }
+      pos += lowestBit(special);
+      if (input[pos++] == '"')
+        return;
+      // Skip the escaped character
+      pos++;
+    }
     while (pos < input.size()) {
-      tokens.back().end = pos;
-      if (input[pos++] == '"') {
+      char c = input[pos++];
+      if (c == '"')
         return;
-      }
+      if (c == '\\')
+        pos++;
     }
     throw JsonParseError("String not terminated");
   }
 
+  // Moves past the bracket matching the one just lexed, without validating
+  // what is in between. Strings are skipped whole so brackets in them are
+  // ignored.
+  void skipContainer() {
+    int depth = 1;
+    while (pos + 64 <= input.size()) {
+      BlockMasks masks = classifyBlock(input.data() + pos);
+      uint64_t bits = masks.quote | masks.structural;
+      size_t block = pos;
+      while (bits) {
+        size_t at = block + lowestBit(bits);
+        bits &= bits - 1;
+        char c = input[at];
+        if (c == '"') {
+          pos = at + 1;
+          tokenString();
+          break;
+        }
+        if (c == '[' || c == '{') {
+          depth++;
+        } else if (c == ']' || c == '}') {
+          if (--depth == 0) {
+            pos = at + 1;
+            return;
+          }
+        }
+      }
+      if (pos == block)
+        pos += 64;
+    }
+    while (pos < input.size()) {
+      char c = input[pos++];
+      if (c == '"') {
+        tokenString();
+      } else if (c == '[' || c == '{') {
+        depth++;
+      } else if ((c == ']' || c == '}') && --depth == 0) {
+        return;
+      }
+    }
+    throw JsonParseError("Unexpected end of file");
+  }
+
   std::vector<JsonToken> tokens;
-  std::string input;
-  int pos;
+  std::string_view input;
+  size_t pos;
 };
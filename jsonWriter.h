@@ -0,0 +1,181 @@
+#pragma once
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+// Appends `str` to `out` as a quoted JSON string, escaping as needed
+inline void appendQuoted(std::string &out, std::string_view str) {
+  static const char hex[] = "0123456789abcdef";
+  out += '"';
+  size_t run = 0;
+  for (size_t i = 0; i < str.size(); i++) {
+    unsigned char c = str[i];
+    if (c >= 0x20 && c != '"' && c != '\\')
+      continue;
+    out.append(str.substr(run, i - run));
+    run = i + 1;
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      out += "\\u00";
+      out += hex[c >> 4];
+      out += hex[c & 0xF];
+    }
+  }
+  out.append(str.substr(run));
+  out += '"';
+}
+
+inline std::string quoteString(std::string_view str) {
+  std::string out;
+  appendQuoted(out, str);
+  return out;
+}
+
+// Serialises JSON in one pass, either appending to a string or through a
+// buffer that is flushed to a FILE* as it fills. Values are written in
+// document order: containers with begin/end calls, and object members with
+// `key` before each value.
+//
+// Compact output separates with ", " and ": ". Pretty output puts each element
+// and member on its own line, indented by two spaces per level.
+struct JsonWriter {
+  explicit JsonWriter(std::string &out, bool pretty = false)
+      : out(out), pretty(pretty) {}
+
+  explicit JsonWriter(FILE *file, bool pretty = false)
+      : out(buffer), file(file), pretty(pretty) {}
+
+  JsonWriter(const JsonWriter &) = delete;
+  JsonWriter &operator=(const JsonWriter &) = delete;
+  ~JsonWriter() { flush(); }
+
+  void null() {
+    separate();
+    out += "null";
+  }
+
+  void boolean(bool val) {
+    separate();
+    out += val ? "true" : "false";
+  }
+
+  void integer(int64_t val) {
+    separate();
+    char digits[24];
+    auto result = std::to_chars(digits, digits + sizeof(digits), val);
+    out.append(digits, result.ptr);
+  }
+
+  // Shortest form that reads back as the same double, always with a fraction
+  // or exponent so it stays a double. JSON has no infinities or NaN, so they
+  // are written as null.
+  void number(double val) {
+    separate();
+    if (!std::isfinite(val)) {
+      out += "null";
+      return;
+    }
+    char digits[32];
+    auto result = std::to_chars(digits, digits + sizeof(digits), val);
+    std::string_view text(digits, result.ptr - digits);
+    out += text;
+    if (text.find_first_of(".e") == std::string_view::npos)
+      out += ".0";
+  }
+
+  void string(std::string_view val) {
+    separate();
+    appendQuoted(out, val);
+  }
+
+  void beginArray() { begin('['); }
+  void endArray() { end(']'); }
+  void beginObject() { begin('{'); }
+  void endObject() { end('}'); }
+
+  void key(std::string_view name) {
+    separate();
+    appendQuoted(out, name);
+    out += ": ";
+    afterKey = true;
+  }
+
+  // Ends the current line of output, e.g. between results
+  void newline() {
+    out += '\n';
+    if (file && out.size() >= flushBytes)
+      flush();
+  }
+
+  void flush() {
+    if (!file || out.empty())
+      return;
+    fwrite(out.data(), 1, out.size(), file);
+    out.clear();
+  }
+
+  void begin(char bracket) {
+    separate();
+    out += bracket;
+    depth++;
+    first = true;
+  }
+
+  void end(char bracket) {
+    depth--;
+    if (pretty && !first)
+      indent();
+    out += bracket;
+    first = false;
+  }
+
+  // Goes before every key and every value that does not follow a key
+  void separate() {
+    if (afterKey) {
+      afterKey = false;
+      return;
+    }
+    if (depth == 0)
+      return;
+    if (file && out.size() >= flushBytes)
+      flush();
+    if (!first)
+      out += pretty ? "," : ", ";
+    first = false;
+    if (pretty)
+      indent();
+  }
+
+  void indent() {
+    out += '\n';
+    out.append(depth * 2, ' ');
+  }
+
+  std::string buffer;
+  std::string &out;
+  FILE *file = nullptr;
+  bool pretty;
+  int depth = 0;
+  // Nothing written yet in the innermost open container
+  bool first = true;
+  bool afterKey = false;
+  size_t flushBytes = 1 << 16;
+};
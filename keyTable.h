@@ -0,0 +1,146 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+inline constexpr uint64_t fnv1a(std::string_view str) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : str) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+// For hash maps keyed by strings whose hashes are already known, such as
+// compiled expressions, so lookups need neither copy nor rehash them
+struct TextKey {
+  std::string_view text;
+  uint64_t hash;
+};
+
+struct TextHash {
+  using is_transparent = void;
+  size_t operator()(std::string_view text) const { return fnv1a(text); }
+  size_t operator()(const TextKey &key) const { return key.hash; }
+};
+
+struct TextEqual {
+  using is_transparent = void;
+  static std::string_view text(std::string_view text) { return text; }
+  static std::string_view text(const TextKey &key) { return key.text; }
+  bool operator()(const auto &a, const auto &b) const {
+    return text(a) == text(b);
+  }
+};
+
+// Object keys of a document, each stored once and numbered in the order they
+// were first seen. Objects refer to their keys by ID, so records with the same
+// fields share the key strings.
+//
+// Lookups may run concurrently, but not while keys are being added.
+struct KeyTable {
+  inline static constexpr uint32_t missing = UINT32_MAX;
+
+  KeyTable() : generation(nextGeneration()) {}
+  KeyTable(const KeyTable &) = delete;
+  KeyTable &operator=(const KeyTable &) = delete;
+
+  // Returns `missing` if the key is not in the table
+  uint32_t find(std::string_view key) const { return find(key, fnv1a(key)); }
+
+  // As above, for a key whose `fnv1a` hash is already known
+  uint32_t find(std::string_view key, uint64_t hash) const {
+    if (slots.empty())
+      return missing;
+    size_t mask = slots.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      uint32_t slot = slots[i];
+      if (slot == 0)
+        return missing;
+      if (entries[slot - 1].hash == hash && entries[slot - 1].name == key)
+        return slot - 1;
+    }
+  }
+
+  // Adds the key if it is not already in the table. A key already there
+  // leaves the table unchanged.
+  uint32_t intern(std::string_view key) {
+    uint64_t hash = fnv1a(key);
+    if (uint32_t id = find(key, hash); id != missing)
+      return id;
+    if (entries.size() * 2 >= slots.size())
+      grow();
+    size_t mask = slots.size() - 1;
+    size_t i = hash & mask;
+    while (slots[i])
+      i = (i + 1) & mask;
+    uint32_t id = entries.size();
+    entries.push_back({std::string(key), hash});
+    slots[i] = id + 1;
+    return id;
+  }
+
+  // Only valid until the next key is added
+  std::string_view name(uint32_t id) const { return entries[id].name; }
+  size_t size() const { return entries.size(); }
+
+  // Kept at most half full
+  void grow() {
+    slots.assign(slots.empty() ? 16 : slots.size() * 2, 0);
+    size_t mask = slots.size() - 1;
+    for (uint32_t id = 0; id < entries.size(); id++) {
+      size_t i = entries[id].hash & mask;
+      while (slots[i])
+        i = (i + 1) & mask;
+      slots[i] = id + 1;
+    }
+  }
+
+  // Distinguishes tables in `KeyCache`, as an address could be reused
+  inline static uint64_t nextGeneration() {
+    static std::atomic<uint64_t> counter{0};
+    return ++counter;
+  }
+
+  struct Entry {
+    std::string name;
+    uint64_t hash;
+  };
+  std::vector<Entry> entries;
+  // ID + 1 by hash, 0 if empty
+  std::vector<uint32_t> slots;
+  uint64_t generation;
+};
+
+// Remembers the ID a key had in the last table it was resolved against, so
+// evaluating an expression over documents that share a table, such as the
+// records of NDJSON, only hashes each key once. Safe to share between threads.
+struct KeyCache {
+  KeyCache() = default;
+  // For a key whose hash is known when the cache is made, such as at compile
+  // time
+  constexpr explicit KeyCache(uint64_t keyHash) : keyHash(keyHash) {}
+
+  uint32_t resolve(const KeyTable &table, std::string_view key) const {
+    uint64_t entry = cached.load(std::memory_order_relaxed);
+    if (entry >> idBits == (table.generation & generationMask))
+      return entry & idMask;
+    uint32_t id = keyHash ? table.find(key, keyHash) : table.find(key);
+    // Keys that are missing may still be added to a table that is reused
+    if (id != KeyTable::missing && id <= idMask)
+      cached.store((table.generation & generationMask) << idBits | id,
+                   std::memory_order_relaxed);
+    return id;
+  }
+
+  // Both fit in one lock-free word. 2^40 tables is beyond any process lifetime.
+  inline static constexpr int idBits = 24;
+  inline static constexpr uint64_t idMask = (1ull << idBits) - 1;
+  inline static constexpr uint64_t generationMask = (1ull << 40) - 1;
+  mutable std::atomic<uint64_t> cached{0};
+  // `fnv1a` of the key, or 0 if not given
+  uint64_t keyHash = 0;
+};
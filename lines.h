@@ -0,0 +1,114 @@
+#pragma once
+#include <deque>
+#include <future>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "expr.h"
+#include "jsonParser.h"
+#include "jsonWriter.h"
+#include "projection.h"
+#include "threadPool.h"
+
+// Evaluates an expression against every record of newline-delimited JSON.
+// The input is split into chunks of whole lines which the workers evaluate in
+// parallel, each with its own parser and output buffer. Chunks are written
+// out in input order as they complete.
+struct LinesEvaluator {
+  struct Chunk {
+    std::string_view text;
+    std::string out;
+    // Records that failed, by line number within the chunk
+    std::vector<std::pair<size_t, std::string>> errors;
+    size_t lines = 0;
+  };
+
+  LinesEvaluator(const CompiledExpr &expr, ThreadPool &pool)
+      : expr(expr), pool(pool), parsers(pool.size()) {
+    // Records usually share their keys, so each worker keeps one table
+    for (auto &parser : parsers)
+      parser.reuseKeys = true;
+  }
+
+  // Returns the number of records that failed. Their errors go to `err`,
+  // prefixed with their line number.
+  size_t run(std::string_view input, std::ostream &out, std::ostream &err) {
+    // Bounds how much output is buffered ahead of the chunk being written
+    size_t window = pool.size() * 4;
+    std::deque<std::pair<std::unique_ptr<Chunk>, std::future<void>>> inflight;
+    size_t pos = 0, line = 1, failed = 0;
+    try {
+      while (pos < input.size() || !inflight.empty()) {
+        while (pos < input.size() && inflight.size() < window) {
+          auto chunk = std::make_unique<Chunk>();
+          size_t end = input.find('\n', pos + chunkBytes - 1);
+          end = end == std::string_view::npos ? input.size() : end + 1;
+          chunk->text = input.substr(pos, end - pos);
+          pos = end;
+          Chunk *c = chunk.get();
+          auto done = pool.submit(
+              [this, c](unsigned worker) { evalChunk(*c, parsers[worker]); });
+          inflight.emplace_back(std::move(chunk), std::move(done));
+        }
+
+        auto &[chunk, done] = inflight.front();
+        done.get();
+        out.write(chunk->out.data(), chunk->out.size());
+        for (auto &[offset, message] : chunk->errors)
+          err << "Line " << line + offset << ": " << message << '\n';
+        failed += chunk->errors.size();
+        line += chunk->lines;
+        inflight.pop_front();
+      }
+    } catch (...) {
+      // Workers still refer to the chunks in flight
+      for (auto &[chunk, done] : inflight) {
+        if (done.valid())
+          done.wait();
+      }
+      throw;
+    }
+    return failed;
+  }
+
+  void evalChunk(Chunk &chunk, JsonParser &parser) {
+    std::string_view text = chunk.text;
+    JsonWriter writer(chunk.out);
+    size_t start = 0;
+    while (start < text.size()) {
+      size_t end = text.find('\n', start);
+      if (end == std::string_view::npos)
+        end = text.size();
+      std::string_view record = text.substr(start, end - start);
+      start = end + 1;
+      size_t offset = chunk.lines++;
+      if (record.find_first_not_of(" \t\r") == std::string_view::npos)
+        continue;
+
+      try {
+        Json doc = projection ? parser.parse(record, *projection)
+                              : parser.parse(record);
+        expr.eval(doc)->write(writer);
+        writer.newline();
+      } catch (JsonParseError &x) {
+        chunk.errors.emplace_back(offset,
+                                  std::string("Json Parse Error: ") + x.what());
+      } catch (InvalidOperation &x) {
+        chunk.errors.emplace_back(
+            offset, std::string("Invalid Operation: ") + x.what());
+      }
+    }
+  }
+
+  const CompiledExpr &expr;
+  ThreadPool &pool;
+  // One per worker, so they never contend
+  std::vector<JsonParser> parsers;
+  // Set to only build what the expression reads, as with `evaluateLazy`
+  const JsonProjection *projection = nullptr;
+  size_t chunkBytes = 1 << 20;
+};
@@ -1,34 +1,353 @@
+#include <charconv>
+#include <csignal>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <new>
+#include <string>
+#include <vector>
 
 #include "eval.h"
+#include "inputFile.h"
+#include "lines.h"
+#include "parallelParser.h"
+#include "server.h"
+#include "snapshot.h"
+#include "stats.h"
+
+#ifdef JSON_EVAL_STATS
+// Every allocation is counted for --stats
+void *operator new(size_t size) {
+  countAllocation(size);
+  if (void *ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+#endif
+
+// Documents this large are parsed on all cores (or `--threads n`)
+Json parseJson(std::string_view input, unsigned threads) {
+  if (input.size() < (64 << 20))
+    return JsonParser().parse(input);
+  ThreadPool pool(threads);
+  return ParallelParser(pool).parse(input);
+}
+
+// Parses every document up front, then answers expressions from stdin or from
+// clients of a Unix domain socket until killed
+int serve(const std::vector<std::string> &paths, const std::string &socketPath,
+          unsigned threads) {
+  QueryServer server;
+  for (auto &path : paths) {
+    InputFile file;
+    if (!file.open(path)) {
+      std::cout << "Error in opening file: " << path << std::endl;
+      return 1;
+    }
+    try {
+      server.addDocument(path, parseJson(file.data(), threads));
+    } catch (JsonParseError &x) {
+      std::cerr << "Json Parse Error: " << path << ": " << x.what();
+      return 1;
+    }
+  }
+
+  if (socketPath.empty()) {
+    server.serveStream(std::cin, std::cout);
+    return 0;
+  }
+#ifdef _WIN32
+  std::cout << "--socket is not supported on Windows" << std::endl;
+  return 1;
+#else
+  // Clients that disconnect early must not kill the server
+  std::signal(SIGPIPE, SIG_IGN);
+  try {
+    server.listen(socketPath);
+  } catch (std::runtime_error &x) {
+    std::cout << x.what() << std::endl;
+    return 1;
+  }
+  ThreadPool pool(threads);
+  server.acceptLoop(pool);
+  return 0;
+#endif
+}
+
+// Parses the document once and saves it for `--load-snapshot`
+int saveSnapshot(const std::string &jsonPath, const std::string &snapshotPath) {
+  InputFile file;
+  if (!file.open(jsonPath)) {
+    std::cout << "Error in opening file: " << jsonPath << std::endl;
+    return 1;
+  }
+  try {
+    DocumentParser parser;
+    Document doc = parser.parseView(file.data());
+    SnapshotWriter writer;
+    if (!writer.save(doc.root, snapshotPath)) {
+      std::cout << "Error in writing file: " << snapshotPath << std::endl;
+      return 1;
+    }
+  } catch (JsonParseError &x) {
+    std::cerr << "Json Parse Error: " << x.what();
+    return 1;
+  }
+  return 0;
+}
+
+// Answers expressions from a snapshot in place, without parsing
+int querySnapshot(const std::string &path,
+                  const std::vector<std::string> &exprs, bool batch,
+                  bool pretty) {
+  try {
+    Snapshot snapshot;
+    if (!timePhase(StatsPhase::READ, [&] { return snapshot.open(path); })) {
+      std::cout << "Error in opening file: " << path << std::endl;
+      return 1;
+    }
+    if (batch) {
+      ExprBatch compiled =
+          timePhase(StatsPhase::COMPILE, [&] { return compileExprs(exprs); });
+      auto results =
+          timePhase(StatsPhase::EVALUATE, [&] { return snapshot.eval(compiled); });
+      StatsTimer timer(StatsPhase::WRITE);
+      JsonWriter writer(stdout, pretty);
+      for (size_t i = 0; i < results.size(); i++) {
+        if (results[i].error.empty())
+          results[i].value.write(writer);
+        else
+          std::cerr << "Expression " << i + 1 << ": " << results[i].error
+                    << '\n';
+        writer.newline();
+      }
+    } else {
+      CompiledExpr expr =
+          timePhase(StatsPhase::COMPILE, [&] { return compileExpr(exprs[0]); });
+      SnapshotValue result =
+          timePhase(StatsPhase::EVALUATE, [&] { return snapshot.eval(expr); });
+      StatsTimer timer(StatsPhase::WRITE);
+      JsonWriter writer(stdout, pretty);
+      result.write(writer);
+      writer.newline();
+    }
+  } catch (ExprParseError &x) {
+    std::cerr << "Expr Parse Error: " << x.what();
+  } catch (InvalidOperation &x) {
+    std::cerr << "Invalid Operation: " << x.what();
+  } catch (SnapshotError &x) {
+    std::cerr << "Snapshot Error: " << x.what();
+  }
+  return 0;
+}
+
+// On stderr, as text or JSON
+void printStats(const std::string &format) {
+  if (format.empty())
+    return;
+  if (!statsEnabled) {
+    std::cerr << "--stats needs a build configured with -DJSON_EVAL_STATS=ON\n";
+    return;
+  }
+  Stats stats = collectStats();
+  if (format == "json") {
+    std::string out;
+    JsonWriter writer(out);
+    stats.write(writer);
+    std::cerr << out << '\n';
+  } else {
+    stats.writeText(std::cerr);
+  }
+}
+
+void printUsage(const char *program) {
+  std::cout << "Usage: " << program
+            << " [--lazy] [--pretty] [--lines] [--threads n]"
+               " [--stats[=json]] [--exprs exprs_file] [json_file]"
+               " [expression...]\n"
+            << "       " << program
+            << " --serve [--socket path [--threads n]] json_file...\n"
+            << "       " << program
+            << " --save-snapshot snapshot_file json_file\n"
+            << "       " << program
+            << " --load-snapshot [--pretty] [--exprs exprs_file]"
+               " snapshot_file [expression...]"
+            << std::endl;
+}
+
+// More than any machine this runs on has cores
+constexpr unsigned maxThreads = 1024;
+
+// `--threads n`, from 1 to `maxThreads`; 0 if `text` is anything else
+unsigned parseThreads(std::string_view text) {
+  unsigned threads = 0;
+  auto [end, error] =
+      std::from_chars(text.data(), text.data() + text.size(), threads);
+  if (error != std::errc() || end != text.data() + text.size() ||
+      threads > maxThreads)
+    return 0;
+  return threads;
+}
 
 int main(int argc, char *argv[]) {
-  if (argc < 3) {
-    std::cout << "Usage: " << argv[0] << " [json_file] [expression]"
-              << std::endl;
+  bool lazy = false;
+  bool lines = false;
+  bool pretty = false;
+  bool serving = false;
+  bool loadSnapshot = false;
+  unsigned threads = 0;
+  std::string exprsPath;
+  std::string socketPath;
+  std::string snapshotPath;
+  std::string statsFormat;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--lazy")
+      lazy = true;
+    else if (arg == "--lines")
+      lines = true;
+    else if (arg == "--pretty")
+      pretty = true;
+    else if (arg == "--threads" && i + 1 < argc) {
+      threads = parseThreads(argv[++i]);
+      if (threads == 0) {
+        std::cout << "Invalid thread count: " << argv[i] << " (expected 1 to "
+                  << maxThreads << ")\n";
+        printUsage(argv[0]);
+        return 1;
+      }
+    }
+    else if (arg == "--exprs" && i + 1 < argc)
+      exprsPath = argv[++i];
+    else if (arg == "--serve")
+      serving = true;
+    else if (arg == "--socket" && i + 1 < argc)
+      socketPath = argv[++i];
+    else if (arg == "--save-snapshot" && i + 1 < argc)
+      snapshotPath = argv[++i];
+    else if (arg == "--load-snapshot")
+      loadSnapshot = true;
+    else if (arg == "--stats" || arg == "--stats=text")
+      statsFormat = "text";
+    else if (arg == "--stats=json")
+      statsFormat = "json";
+    else
+      args.push_back(arg);
+  }
+
+  statsActive = !statsFormat.empty();
+
+  if (serving && !args.empty())
+    return serve(args, socketPath, threads);
+  if (!snapshotPath.empty() && args.size() == 1)
+    return saveSnapshot(args[0], snapshotPath);
+
+  // Every expression after the file, then any from `--exprs`, one per line
+  std::vector<std::string> exprs;
+  if (!args.empty())
+    exprs.assign(args.begin() + 1, args.end());
+  if (!exprsPath.empty()) {
+    std::ifstream exprsFile(exprsPath);
+    if (exprsFile.fail()) {
+      std::cout << "Error in opening file: " << exprsPath << std::endl;
+      return 1;
+    }
+    std::string line;
+    while (std::getline(exprsFile, line)) {
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if (!line.empty())
+        exprs.push_back(line);
+    }
+  }
+
+  if (args.empty() || exprs.empty()) {
+    printUsage(argv[0]);
     return 0;
   }
+  bool batch = exprs.size() > 1 || !exprsPath.empty();
+  if (lines && exprs.size() > 1) {
+    std::cout << "--lines takes a single expression" << std::endl;
+    return 1;
+  }
 
-  std::string jsonPath = argv[1];
+  if (loadSnapshot) {
+    if (lines) {
+      std::cout << "--lines cannot be used with a snapshot" << std::endl;
+      return 1;
+    }
+    int status = querySnapshot(args[0], exprs, batch, pretty);
+    printStats(statsFormat);
+    return status;
+  }
+
+  std::string jsonPath = args[0];
 
-  std::ifstream file(jsonPath);
-  if (file.fail()) {
+  // Parsed straight from the mapping, or from a buffer for pipes and stdin
+  InputFile file;
+  if (!timePhase(StatsPhase::READ, [&] { return file.open(jsonPath); })) {
     std::cout << "Error in opening file: " << jsonPath << std::endl;
     return 1;
   }
-
-  std::stringstream jsonInput;
-  jsonInput << file.rdbuf();
+  std::string_view jsonInput = file.data();
 
   try {
-    Json result = evaluate(jsonInput.str(), argv[2]);
-    std::cout << result->toString() << std::endl;
-  } catch (JsonParseError x) {
+    if (lines) {
+      // One record per line, evaluated on all cores
+      CompiledExpr expr = compileExpr(exprs[0]);
+      JsonProjection projection = projectExpr(expr);
+      ThreadPool pool(threads);
+      LinesEvaluator evaluator(expr, pool);
+      if (lazy)
+        evaluator.projection = &projection;
+      // Parsing and writing each record are part of evaluating it
+      StatsTimer timer(StatsPhase::EVALUATE);
+      evaluator.run(jsonInput, std::cout, std::cerr);
+    } else if (batch) {
+      // Compiled first, so --lazy knows what to build
+      ExprBatch compiled =
+          timePhase(StatsPhase::COMPILE, [&] { return compileExprs(exprs); });
+      Json doc = timePhase(StatsPhase::PARSE, [&] {
+        return lazy ? JsonParser().parse(jsonInput, projectBatch(compiled))
+                    : parseJson(jsonInput, threads);
+      });
+      auto results =
+          timePhase(StatsPhase::EVALUATE, [&] { return compiled.eval(doc); });
+      // One line of output per expression, left empty if it failed
+      StatsTimer timer(StatsPhase::WRITE);
+      JsonWriter writer(stdout, pretty);
+      for (size_t i = 0; i < results.size(); i++) {
+        if (results[i].error.empty())
+          results[i].value->write(writer);
+        else
+          std::cerr << "Expression " << i + 1 << ": " << results[i].error
+                    << '\n';
+        writer.newline();
+      }
+    } else {
+      CompiledExpr expr =
+          timePhase(StatsPhase::COMPILE, [&] { return compileExpr(exprs[0]); });
+      Json doc = timePhase(StatsPhase::PARSE, [&] {
+        return lazy ? JsonParser().parse(jsonInput, projectExpr(expr))
+                    : parseJson(jsonInput, threads);
+      });
+      Json result =
+          timePhase(StatsPhase::EVALUATE, [&] { return expr.eval(doc); });
+      // Written straight to stdout rather than built up as a string first
+      StatsTimer timer(StatsPhase::WRITE);
+      JsonWriter writer(stdout, pretty);
+      result->write(writer);
+      writer.newline();
+    }
+  } catch (JsonParseError &x) {
     std::cerr << "Json Parse Error: " << x.what();
-  } catch (ExprParseError x) {
+  } catch (ExprParseError &x) {
     std::cerr << "Expr Parse Error: " << x.what();
-  } catch (InvalidOperation x) {
+  } catch (InvalidOperation &x) {
     std::cerr << "Invalid Operation: " << x.what();
   }
+  printStats(statsFormat);
 }
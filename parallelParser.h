@@ -0,0 +1,180 @@
+#pragma once
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "json.h"
+#include "jsonParser.h"
+#include "jsonTokeniser.h"
+#include "keyTable.h"
+#include "threadPool.h"
+
+// Parses one large document on several threads. Large arrays, either the
+// document itself or members of a top-level object, are split into runs of
+// whole elements by bracket matching, which is much faster than parsing. The
+// workers parse the runs, each into its own key table, and the parts are
+// joined back into one array. Everything else, and the bracket matching, is
+// done on the calling thread.
+struct ParallelParser {
+  explicit ParallelParser(ThreadPool &pool) : pool(pool), parsers(pool.size()) {
+    main.reuseKeys = true;
+  }
+
+  Json parse(std::string_view input_) {
+    if (input_.size() < runBytes * 2)
+      return JsonParser().parse(input_);
+    input = input_;
+    tokeniser.reset(input);
+    main.keys = std::make_shared<KeyTable>();
+    JsonToken token = tokeniser.next();
+    Json root;
+    if (token.type == JsonTokenType::LEFT_SQUARE)
+      root = parseArray(token.start);
+    else if (token.type == JsonTokenType::LEFT_CURLY)
+      root = parseObject();
+    else
+      return JsonParser().parse(input);
+    if (tokeniser.next().type != JsonTokenType::EOF_)
+      throw JsonParseError("Unexpected token");
+    return root;
+  }
+
+  // Members are parsed one at a time, from the text each one spans
+  Json parseObject() {
+    auto obj = std::make_shared<JsonObject>(main.keys);
+    JsonToken token = tokeniser.next();
+    if (token.type == JsonTokenType::RIGHT_CURLY)
+      return obj;
+    while (true) {
+      if (token.type != JsonTokenType::STRING)
+        throw JsonParseError("Expected string key");
+      std::string key;
+      decodeString(input.substr(token.start + 1, token.end - token.start - 1),
+                   key);
+      if (tokeniser.next().type != JsonTokenType::COLON)
+        throw JsonParseError("Colon expected after key in object");
+
+      JsonToken value = tokeniser.next();
+      if (value.type == JsonTokenType::LEFT_SQUARE) {
+        obj->set(obj->keys->intern(key), parseArray(value.start));
+      } else {
+        if (value.type == JsonTokenType::LEFT_CURLY)
+          tokeniser.skipContainer();
+        std::string_view text =
+            input.substr(value.start, tokeniser.pos - value.start);
+        obj->set(obj->keys->intern(key), main.parse(text));
+      }
+
+      token = tokeniser.next();
+      if (token.type == JsonTokenType::RIGHT_CURLY)
+        return obj;
+      if (token.type != JsonTokenType::COMMA)
+        throw JsonParseError("Comma expected between elements of object");
+      token = tokeniser.next();
+    }
+  }
+
+  // `start` is the position of the opening bracket, which has been lexed.
+  // Runs are handed to the workers as soon as they are found, so parsing
+  // overlaps the bracket matching of what follows.
+  Json parseArray(size_t start) {
+    // Held back until there is a second. An array of one run is parsed here,
+    // as it would gain nothing from a worker; otherwise every run, `first`
+    // included, goes to the pool while this thread matches brackets.
+    std::string_view first;
+    std::deque<Json> parts;
+    std::vector<std::future<void>> done;
+    auto submit = [&](std::string_view run) {
+      Json *part = &parts.emplace_back();
+      done.push_back(pool.submit([this, run, part](unsigned worker) {
+        *part = parsers[worker].parseRun(run);
+      }));
+    };
+    try {
+      JsonToken token = tokeniser.next();
+      size_t runStart = token.start;
+      while (token.type != JsonTokenType::RIGHT_SQUARE) {
+        if (token.type == JsonTokenType::LEFT_SQUARE ||
+            token.type == JsonTokenType::LEFT_CURLY)
+          tokeniser.skipContainer();
+        size_t end = tokeniser.pos;
+        token = tokeniser.next();
+        bool last = token.type == JsonTokenType::RIGHT_SQUARE;
+        if (!last && token.type != JsonTokenType::COMMA)
+          throw JsonParseError("Comma expected between elements of array");
+        if (last || end - runStart >= runBytes) {
+          std::string_view run = input.substr(runStart, end - runStart);
+          if (!first.data() && !last) {
+            first = run;
+          } else if (first.data()) {
+            if (parts.empty())
+              submit(first);
+            submit(run);
+          }
+          runStart = std::string_view::npos;
+        }
+        if (!last) {
+          token = tokeniser.next();
+          if (runStart == std::string_view::npos)
+            runStart = token.start;
+        }
+      }
+    } catch (...) {
+      // Workers still refer to `parts`
+      for (auto &task : done)
+        task.wait();
+      throw;
+    }
+    if (parts.empty())
+      return main.parse(input.substr(start, tokeniser.pos - start));
+
+    for (auto &task : done)
+      task.wait();
+    for (auto &task : done)
+      task.get();
+    return join(parts);
+  }
+
+  // Packed if every part was packed the same way
+  static Json join(std::deque<Json> &parts) {
+    if (Json packed = joinPacked<JsonIntArray>(parts))
+      return packed;
+    if (Json packed = joinPacked<JsonDoubleArray>(parts))
+      return packed;
+    auto arr = std::make_shared<JsonArray>();
+    for (Json &part : parts) {
+      if (auto *boxed = dynamic_cast<JsonArray *>(part.get())) {
+        for (Json &elem : boxed->arr)
+          arr->arr.push_back(std::move(elem));
+      } else {
+        for (int i = 0; i < part->size(); i++)
+          arr->arr.push_back(part->getIndex(i));
+      }
+    }
+    return arr;
+  }
+
+  template <class Packed> static Json joinPacked(std::deque<Json> &parts) {
+    decltype(Packed::vals) vals;
+    for (Json &part : parts) {
+      auto *packed = dynamic_cast<Packed *>(part.get());
+      if (!packed)
+        return nullptr;
+      vals.insert(vals.end(), packed->vals.begin(), packed->vals.end());
+    }
+    return std::make_shared<Packed>(std::move(vals));
+  }
+
+  ThreadPool &pool;
+  // One per worker, so they never contend
+  std::vector<JsonParser> parsers;
+  // Parses what is not split, sharing one key table
+  JsonParser main;
+  JsonTokeniser tokeniser;
+  std::string_view input;
+  // Arrays smaller than this are not split
+  size_t runBytes = 1 << 20;
+};
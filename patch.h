@@ -0,0 +1,408 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "json.h"
+
+// Changes to a parsed document, as JSON Patch (RFC 6902) operations on paths
+// written as JSON Pointers (RFC 6901), e.g. `/a/b/0`.
+//
+// Nodes are never changed in place. An edit copies the nodes on the path to
+// it and shares everything else with the old version, so it costs the width
+// of those nodes rather than the size of the document, and anyone holding the
+// old root still sees it whole. Later operations of the same patch change the
+// copies in place.
+
+struct JsonPatchError : std::runtime_error {
+  inline JsonPatchError(const std::string &key) : std::runtime_error(key) {}
+};
+
+enum class PatchOp { ADD, REMOVE, REPLACE, MOVE, COPY, TEST };
+
+struct JsonPatch {
+  struct Operation {
+    PatchOp op;
+    std::string path;
+    // MOVE and COPY
+    std::string from;
+    // ADD, REPLACE and TEST
+    Json value;
+  };
+
+  JsonPatch() = default;
+  // `ops` is the patch document: an array of operation objects
+  explicit JsonPatch(const Json &ops) {
+    auto *arr = dynamic_cast<JsonArray *>(ops.get());
+    if (!arr)
+      throw JsonPatchError("Patch must be an array of operations");
+    for (const Json &op : arr->arr)
+      this->ops.push_back(parseOperation(op));
+  }
+
+  // Either every operation applies or the patch throws, leaving `root` as it
+  // was
+  Json apply(Json root) const {
+    Owned owned;
+    for (const Operation &op : ops) {
+      switch (op.op) {
+      case PatchOp::ADD:
+        root = add(root, op.path, op.value, &owned);
+        break;
+      case PatchOp::REMOVE:
+        root = remove(root, op.path, &owned);
+        break;
+      case PatchOp::REPLACE:
+        root = replace(root, op.path, op.value, &owned);
+        break;
+      case PatchOp::MOVE:
+        if (op.path.starts_with(op.from + "/"))
+          throw JsonPatchError("Cannot move " + op.from + " into itself");
+        if (op.path != op.from) {
+          Json value = get(root, op.from);
+          root = add(remove(root, op.from, &owned), op.path, value, &owned);
+        }
+        break;
+      case PatchOp::COPY:
+        root = add(root, op.path, get(root, op.from), &owned);
+        // Copies of the same node must not change together
+        owned.clear();
+        break;
+      case PatchOp::TEST:
+        if (!equal(get(root, op.path), op.value))
+          throw JsonPatchError("Test failed at " + op.path);
+        break;
+      }
+    }
+    return root;
+  }
+
+  static Operation parseOperation(const Json &op) {
+    auto *obj = dynamic_cast<JsonObject *>(op.get());
+    if (!obj)
+      throw JsonPatchError("Patch operation must be an object");
+    static const std::pair<const char *, PatchOp> names[] = {
+        {"add", PatchOp::ADD},   {"remove", PatchOp::REMOVE},
+        {"replace", PatchOp::REPLACE}, {"move", PatchOp::MOVE},
+        {"copy", PatchOp::COPY}, {"test", PatchOp::TEST}};
+    std::string name = memberString(*obj, "op");
+    Operation parsed;
+    auto it = std::find_if(std::begin(names), std::end(names),
+                           [&](auto &entry) { return name == entry.first; });
+    if (it == std::end(names))
+      throw JsonPatchError("Unknown patch operation: " + name);
+    parsed.op = it->second;
+    parsed.path = memberString(*obj, "path");
+    parsePointer(parsed.path);
+    if (parsed.op == PatchOp::MOVE || parsed.op == PatchOp::COPY) {
+      parsed.from = memberString(*obj, "from");
+      parsePointer(parsed.from);
+    }
+    if (parsed.op == PatchOp::ADD || parsed.op == PatchOp::REPLACE ||
+        parsed.op == PatchOp::TEST) {
+      Json *value = obj->find(obj->keys->find("value"));
+      if (!value)
+        throw JsonPatchError("Patch operation " + name + " needs a value");
+      parsed.value = *value;
+    }
+    return parsed;
+  }
+
+  static std::string memberString(JsonObject &obj, std::string_view key) {
+    Json *val = obj.find(obj.keys->find(key));
+    auto *str = val ? dynamic_cast<JsonString *>(val->get()) : nullptr;
+    if (!str)
+      throw JsonPatchError("Patch operation needs a string " +
+                           std::string(key));
+    return str->val;
+  }
+
+  // The reference tokens of a JSON Pointer, with `~1` and `~0` unescaped
+  static std::vector<std::string> parsePointer(std::string_view pointer) {
+    std::vector<std::string> tokens;
+    if (pointer.empty())
+      return tokens;
+    if (pointer[0] != '/')
+      throw JsonPatchError("JSON Pointer must start with /: " +
+                           std::string(pointer));
+    for (size_t i = 1;; i++) {
+      std::string &token = tokens.emplace_back();
+      for (; i < pointer.size() && pointer[i] != '/'; i++) {
+        if (pointer[i] != '~') {
+          token += pointer[i];
+        } else if (i + 1 < pointer.size() &&
+                   (pointer[i + 1] == '0' || pointer[i + 1] == '1')) {
+          token += pointer[++i] == '0' ? '~' : '/';
+        } else {
+          throw JsonPatchError("Invalid escape in JSON Pointer: " +
+                               std::string(pointer));
+        }
+      }
+      if (i == pointer.size())
+        return tokens;
+    }
+  }
+
+  static Json get(const Json &root, std::string_view pointer) {
+    Json node = root;
+    for (const std::string &token : parsePointer(pointer))
+      node = child(node, token);
+    return node;
+  }
+
+  // Nodes and key tables made by the patch being applied. No reader can hold
+  // them yet, so they are changed in place.
+  using Owned = std::unordered_set<const void *>;
+
+  // Sets an object member, or inserts into an array before the index (`-`
+  // appends). An empty pointer replaces the whole document.
+  static Json add(const Json &root, std::string_view pointer, Json value,
+                  Owned *owned = nullptr) {
+    return edit(root, parsePointer(pointer), 0, PatchOp::ADD, std::move(value),
+                owned);
+  }
+
+  static Json remove(const Json &root, std::string_view pointer,
+                     Owned *owned = nullptr) {
+    std::vector<std::string> tokens = parsePointer(pointer);
+    if (tokens.empty())
+      throw JsonPatchError("Cannot remove the whole document");
+    return edit(root, tokens, 0, PatchOp::REMOVE, nullptr, owned);
+  }
+
+  // As `add`, but the target must already exist
+  static Json replace(const Json &root, std::string_view pointer, Json value,
+                      Owned *owned = nullptr) {
+    return edit(root, parsePointer(pointer), 0, PatchOp::REPLACE,
+                std::move(value), owned);
+  }
+
+  // Copies the nodes from `node` down to the target of `tokens[depth...]`
+  static Json edit(const Json &node, const std::vector<std::string> &tokens,
+                   size_t depth, PatchOp op, Json value, Owned *owned) {
+    if (depth == tokens.size())
+      return value;
+    const std::string &token = tokens[depth];
+    if (depth + 1 == tokens.size())
+      return editChild(node, token, op, std::move(value), owned);
+    Json next = edit(child(node, token), tokens, depth + 1, op,
+                     std::move(value), owned);
+    return editChild(node, token, PatchOp::REPLACE, std::move(next), owned);
+  }
+
+  template <class T>
+  static std::shared_ptr<T> copyOf(const Json &node, T &val, Owned *owned) {
+    if (owned && owned->contains(&val))
+      return std::static_pointer_cast<T>(node);
+    auto copy = std::make_shared<T>(val);
+    if (owned)
+      owned->insert(copy.get());
+    return copy;
+  }
+
+  static Json child(const Json &node, const std::string &token) {
+    if (auto *obj = dynamic_cast<JsonObject *>(node.get())) {
+      if (Json *val = obj->find(obj->keys->find(token)))
+        return *val;
+      throw JsonPatchError("Key not in object: " + token);
+    }
+    if (isArray(node))
+      return node->getIndex(indexOf(token, node->size(), false));
+    throw JsonPatchError("Cannot look up " + token + " in a scalar");
+  }
+
+  // A copy of the container `node` with the member at `token` changed
+  static Json editChild(const Json &node, const std::string &token, PatchOp op,
+                        Json value, Owned *owned) {
+    if (auto *obj = dynamic_cast<JsonObject *>(node.get()))
+      return editMember(node, *obj, token, op, std::move(value), owned);
+    if (auto *arr = dynamic_cast<JsonArray *>(node.get())) {
+      size_t index = indexOf(token, arr->arr.size(), op == PatchOp::ADD);
+      auto copy = copyOf(node, *arr, owned);
+      if (op == PatchOp::ADD)
+        copy->arr.insert(copy->arr.begin() + index, std::move(value));
+      else if (op == PatchOp::REMOVE)
+        copy->arr.erase(copy->arr.begin() + index);
+      else
+        copy->arr[index] = std::move(value);
+      return copy;
+    }
+    if (auto *packed = dynamic_cast<JsonIntArray *>(node.get()))
+      return editPacked(node, *packed, token, op, std::move(value), owned);
+    if (auto *packed = dynamic_cast<JsonDoubleArray *>(node.get()))
+      return editPacked(node, *packed, token, op, std::move(value), owned);
+    throw JsonPatchError("Cannot change " + token + " in a scalar");
+  }
+
+  static Json editMember(const Json &node, JsonObject &obj,
+                         const std::string &token, PatchOp op, Json value,
+                         Owned *owned) {
+    uint32_t id = obj.keys->find(token);
+    if (!obj.find(id) && op != PatchOp::ADD)
+      throw JsonPatchError("Key not in object: " + token);
+    auto copy = copyOf(node, obj, owned);
+    if (op == PatchOp::REMOVE) {
+      copy->members.erase(
+          std::find_if(copy->members.begin(), copy->members.end(),
+                       [&](auto &member) { return member.first == id; }));
+      if (copy->members.size() > JsonObject::indexThreshold)
+        copy->reindex();
+      else
+        copy->index.clear();
+      return copy;
+    }
+    if (id == KeyTable::missing && !(owned && owned->contains(&*copy->keys))) {
+      // The table is shared with the old version, which may be being read, so
+      // the copy gets a table of its own keys
+      auto keys = std::make_shared<KeyTable>();
+      for (auto &member : copy->members)
+        member.first = keys->intern(copy->keys->name(member.first));
+      copy->keys = std::move(keys);
+      if (owned)
+        owned->insert(&*copy->keys);
+      if (!copy->index.empty())
+        copy->reindex();
+    }
+    // A key the table already has is set by its ID, so the shared table is
+    // only read
+    if (id == KeyTable::missing)
+      copy->set(token, std::move(value));
+    else
+      copy->set(id, std::move(value));
+    return copy;
+  }
+
+  // Stays packed while every value fits, otherwise the elements are boxed
+  template <class T, class Element>
+  static Json editPacked(const Json &node, JsonPackedArray<T, Element> &packed,
+                         const std::string &token, PatchOp op, Json value,
+                         Owned *owned) {
+    size_t index = indexOf(token, packed.vals.size(), op == PatchOp::ADD);
+    auto *elem = dynamic_cast<Element *>(value.get());
+    if (op != PatchOp::REMOVE && !elem) {
+      auto boxed = std::make_shared<JsonArray>();
+      for (T val : packed.vals)
+        boxed->arr.push_back(std::make_shared<Element>(val));
+      Owned boxedOwned;
+      if (!owned)
+        owned = &boxedOwned;
+      owned->insert(boxed.get());
+      return editChild(boxed, token, op, std::move(value), owned);
+    }
+    // Packed arrays are never empty
+    if (op == PatchOp::REMOVE && packed.vals.size() == 1)
+      return std::make_shared<JsonArray>();
+    auto copy = copyOf(node, packed, owned);
+    if (op == PatchOp::ADD)
+      copy->vals.insert(copy->vals.begin() + index, elem->val);
+    else if (op == PatchOp::REMOVE)
+      copy->vals.erase(copy->vals.begin() + index);
+    else
+      copy->vals[index] = elem->val;
+    return copy;
+  }
+
+  // `-`, one past the end, is only allowed when `append` is
+  static size_t indexOf(const std::string &token, size_t size, bool append) {
+    if (token == "-" && append)
+      return size;
+    bool digits = !token.empty() && token.size() <= 18 &&
+                  (token == "0" || token[0] != '0') &&
+                  std::all_of(token.begin(), token.end(),
+                              [](char c) { return c >= '0' && c <= '9'; });
+    if (!digits)
+      throw JsonPatchError("Invalid array index: " + token);
+    size_t index = std::stoull(token);
+    if (index > size || (index == size && !append))
+      throw JsonPatchError("Array index out of range: " + token);
+    return index;
+  }
+
+  static bool isArray(const Json &node) {
+    return dynamic_cast<JsonArray *>(node.get()) ||
+           dynamic_cast<JsonIntArray *>(node.get()) ||
+           dynamic_cast<JsonDoubleArray *>(node.get());
+  }
+
+  // As RFC 6902 `test` compares: numbers by value, objects regardless of
+  // member order
+  static bool equal(const Json &a, const Json &b) {
+    auto isNumber = [](const Json &node) {
+      return dynamic_cast<JsonInt *>(node.get()) ||
+             dynamic_cast<JsonNumber *>(node.get());
+    };
+    if (isNumber(a) || isNumber(b))
+      return isNumber(a) && isNumber(b) && a->getNumber() == b->getNumber();
+    if (isArray(a) || isArray(b)) {
+      if (!isArray(a) || !isArray(b) || a->size() != b->size())
+        return false;
+      for (int i = 0; i < a->size(); i++) {
+        if (!equal(a->getIndex(i), b->getIndex(i)))
+          return false;
+      }
+      return true;
+    }
+    if (auto *objA = dynamic_cast<JsonObject *>(a.get())) {
+      auto *objB = dynamic_cast<JsonObject *>(b.get());
+      if (!objB || objA->members.size() != objB->members.size())
+        return false;
+      for (auto &[id, val] : objA->members) {
+        Json *other = objB->find(objB->keys->find(objA->keys->name(id)));
+        if (!other || !equal(val, *other))
+          return false;
+      }
+      return true;
+    }
+    if (auto *strA = dynamic_cast<JsonString *>(a.get())) {
+      auto *strB = dynamic_cast<JsonString *>(b.get());
+      return strB && strA->val == strB->val;
+    }
+    if (auto *boolA = dynamic_cast<JsonBool *>(a.get())) {
+      auto *boolB = dynamic_cast<JsonBool *>(b.get());
+      return boolB && boolA->val == boolB->val;
+    }
+    return dynamic_cast<JsonNull *>(a.get()) &&
+           dynamic_cast<JsonNull *>(b.get());
+  }
+
+  std::vector<Operation> ops;
+};
+
+// The latest version of a document that changes while it is read. Readers
+// take the root and see that version for as long as they hold it; writers
+// publish a new root patched from the latest one. Neither waits on the other
+// for longer than it takes to copy a pointer.
+struct SharedRoot {
+  explicit SharedRoot(Json root) : root(std::move(root)) {}
+  SharedRoot(const SharedRoot &) = delete;
+  SharedRoot &operator=(const SharedRoot &) = delete;
+
+  Json load() const {
+    std::lock_guard<std::mutex> lock(rootMutex);
+    return root;
+  }
+
+  void store(Json next) {
+    std::lock_guard<std::mutex> lock(rootMutex);
+    root.swap(next);
+    // The old root, if this held the last reference, is freed after unlocking
+  }
+
+  // Writers are serialised, so none loses another's changes
+  Json update(const JsonPatch &patch) {
+    std::lock_guard<std::mutex> lock(writeMutex);
+    Json next = patch.apply(load());
+    store(next);
+    return next;
+  }
+
+  Json root;
+  mutable std::mutex rootMutex;
+  std::mutex writeMutex;
+};
@@ -0,0 +1,158 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "expr.h"
+
+// The parts of a document an expression can read. `JsonParser` skips anything
+// outside it without building it.
+struct JsonProjection {
+  const JsonProjection *member(std::string_view name) const {
+    for (auto &[key, child] : keys) {
+      if (key == name)
+        return child.get();
+    }
+    return nullptr;
+  }
+
+  const JsonProjection *element(int64_t i) const {
+    for (auto &[index, child] : indices) {
+      if (index == i)
+        return child.get();
+    }
+    return anyIndex.get();
+  }
+
+  JsonProjection &key(std::string_view name) {
+    for (auto &[key, child] : keys) {
+      if (key == name)
+        return *child;
+    }
+    keys.emplace_back(name, std::make_unique<JsonProjection>());
+    return *keys.back().second;
+  }
+
+  JsonProjection &index(int64_t i) {
+    for (auto &[index, child] : indices) {
+      if (index == i)
+        return *child;
+    }
+    indices.emplace_back(i, std::make_unique<JsonProjection>());
+    return *indices.back().second;
+  }
+
+  JsonProjection &any() {
+    if (!anyIndex)
+      anyIndex = std::make_unique<JsonProjection>();
+    return *anyIndex;
+  }
+
+  void merge(const JsonProjection &other) {
+    whole |= other.whole;
+    for (auto &[name, child] : other.keys)
+      key(name).merge(*child);
+    for (auto &[i, child] : other.indices)
+      index(i).merge(*child);
+    if (other.anyIndex)
+      any().merge(*other.anyIndex);
+  }
+
+  // Elements with a literal subscript can also be reached by a computed one
+  void finish() {
+    for (auto &[i, child] : indices) {
+      if (anyIndex)
+        child->merge(*anyIndex);
+      child->finish();
+    }
+    for (auto &[name, child] : keys)
+      child->finish();
+    if (anyIndex)
+      anyIndex->finish();
+  }
+
+  // The value is read as a whole, e.g. as the result or an argument to size()
+  bool whole = false;
+  std::vector<std::pair<std::string, std::unique_ptr<JsonProjection>>> keys;
+  std::vector<std::pair<int64_t, std::unique_ptr<JsonProjection>>> indices;
+  // Applies to every element, for subscripts only known during evaluation
+  std::unique_ptr<JsonProjection> anyIndex;
+};
+
+struct ExprProjector {
+  JsonProjection project(const CompiledExpr &expr) {
+    JsonProjection root;
+    markWhole(*expr.root, root);
+    root.finish();
+    return root;
+  }
+
+  // Everything any of the expressions reads
+  JsonProjection project(const ExprBatch &batch) {
+    JsonProjection root;
+    for (auto &expr : batch.exprs) {
+      if (expr.root)
+        markWhole(*expr.root, root);
+    }
+    root.finish();
+    return root;
+  }
+
+  void markWhole(const ExprNode &node, JsonProjection &root) {
+    if (JsonProjection *projection = projectPath(node, root))
+      projection->whole = true;
+  }
+
+  // Returns the projection of the value `node` evaluates to, or nullptr if it
+  // is not a part of the document
+  JsonProjection *projectPath(const ExprNode &node, JsonProjection &root) {
+    switch (node.type) {
+    case ExprNodeType::GLOBAL:
+      return &root;
+
+    case ExprNodeType::LITERAL:
+      return nullptr;
+
+    case ExprNodeType::KEY:
+    case ExprNodeType::OPT_KEY: {
+      JsonProjection *base = projectPath(*node.base, root);
+      return base ? &base->key(node.key) : nullptr;
+    }
+
+    case ExprNodeType::INDEX:
+    case ExprNodeType::OPT_INDEX: {
+      const ExprNode &index = *node.args[0];
+      markWhole(index, root);
+      JsonProjection *base = projectPath(*node.base, root);
+      if (!base)
+        return nullptr;
+      if (index.type == ExprNodeType::LITERAL && index.literalNode.type ==
+                                                    JsonNodeType::INT)
+        return &base->index(index.literalNode.integer);
+      return &base->any();
+    }
+
+    case ExprNodeType::MIN:
+    case ExprNodeType::MAX:
+    case ExprNodeType::SIZE:
+    case ExprNodeType::COALESCE:
+      for (auto &arg : node.args)
+        markWhole(*arg, root);
+      return nullptr;
+    }
+    throw; // Unreachable
+  }
+};
+
+inline JsonProjection projectExpr(const CompiledExpr &expr) {
+  ExprProjector projector;
+  return projector.project(expr);
+}
+
+inline JsonProjection projectBatch(const ExprBatch &batch) {
+  ExprProjector projector;
+  return projector.project(batch);
+}
@@ -0,0 +1,339 @@
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <deque>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "eval.h"
+#include "jsonWriter.h"
+#include "patch.h"
+#include "threadPool.h"
+
+// Answers expressions against documents that are parsed once and then shared
+// by every client.
+//
+// Each request is one line holding an expression, optionally preceded by
+// `@name ` to pick a document other than the first. Each response is one line
+// holding the result, or `Error: ` and the reason (no JSON value starts with
+// `E`).
+//
+// A request of `!` and a JSON Patch changes the document instead, and is
+// answered with `true`. Requests already being answered finish against the
+// version they started with. Requests longer than `maxRequestBytes` are
+// answered with an error without being read in full.
+struct QueryServer {
+#ifndef _WIN32
+  ~QueryServer() {
+    for (int fd : wake) {
+      if (fd >= 0)
+        close(fd);
+    }
+  }
+#endif
+
+  void addDocument(std::string name, Json doc) {
+    documents.emplace_back(std::piecewise_construct,
+                           std::forward_as_tuple(std::move(name)),
+                           std::forward_as_tuple(std::move(doc)));
+  }
+
+  // Appends the response, with its newline, to `out`
+  void answer(std::string_view request, std::string &out) {
+    if (!request.empty() && request.back() == '\r')
+      request.remove_suffix(1);
+    if (request.size() > maxRequestBytes) {
+      out += "Error: Request too long\n";
+      return;
+    }
+    try {
+      SharedRoot *doc = &documents.at(0).second;
+      if (request.starts_with('@')) {
+        size_t end = request.find(' ');
+        std::string_view name = request.substr(1, end - 1);
+        doc = findDocument(name);
+        if (!doc)
+          throw std::invalid_argument("Unknown document: " + std::string(name));
+        request = end == std::string_view::npos ? "" : request.substr(end + 1);
+      }
+      if (request.starts_with('!')) {
+        doc->update(JsonPatch(JsonParser().parse(request.substr(1))));
+        out += "true\n";
+        return;
+      }
+      Json result = compile(std::string(request)).eval(doc->load());
+      JsonWriter writer(out);
+      result->write(writer);
+    } catch (JsonParseError &x) {
+      out += "Error: Json Parse Error: ";
+      out += x.what();
+    } catch (JsonPatchError &x) {
+      out += "Error: Json Patch Error: ";
+      out += x.what();
+    } catch (ExprParseError &x) {
+      out += "Error: Expr Parse Error: ";
+      out += x.what();
+    } catch (InvalidOperation &x) {
+      out += "Error: Invalid Operation: ";
+      out += x.what();
+    } catch (std::invalid_argument &x) {
+      out += "Error: ";
+      out += x.what();
+    }
+    out += '\n';
+  }
+
+  SharedRoot *findDocument(std::string_view name) {
+    for (auto &[docName, doc] : documents) {
+      if (docName == name)
+        return &doc;
+    }
+    return nullptr;
+  }
+
+  // Expressions are compiled once and shared between clients. The cache is
+  // simply emptied when full.
+  CompiledExpr compile(const std::string &expr) {
+    {
+      std::lock_guard<std::mutex> lock(cacheMutex);
+      if (auto it = cache.find(expr); it != cache.end())
+        return it->second;
+    }
+    CompiledExpr compiled = compileExpr(expr);
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    if (cache.size() >= maxCached)
+      cache.clear();
+    cache.emplace(expr, compiled);
+    return compiled;
+  }
+
+  // Answers requests in order until `in` ends. Responses are flushed whenever
+  // no more input is waiting, so interactive clients are not kept waiting.
+  void serveStream(std::istream &in, std::ostream &out) {
+    std::string line, response;
+    while (std::getline(in, line)) {
+      response.clear();
+      answer(line, response);
+      out.write(response.data(), response.size());
+      if (in.rdbuf()->in_avail() <= 0)
+        out.flush();
+    }
+    out.flush();
+  }
+
+#ifndef _WIN32
+  // Binds a Unix domain socket, replacing any left by an earlier run
+  void listen(const std::string &path) {
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path))
+      throw std::runtime_error("Socket path too long: " + path);
+    addr.sun_family = AF_UNIX;
+    path.copy(addr.sun_path, path.size());
+    if (wake[0] < 0) {
+      if (pipe(wake) < 0)
+        throw std::runtime_error("Cannot create pipe");
+      for (int fd : wake)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+      throw std::runtime_error("Cannot create socket");
+    unlink(path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) <
+            0 ||
+        ::listen(listener, 64) < 0) {
+      close(listener);
+      listener = -1;
+      throw std::runtime_error("Cannot listen on " + path);
+    }
+  }
+
+  // A client, either waiting in `acceptLoop` or being answered on a worker
+  struct Connection {
+    explicit Connection(int fd) : fd(fd) {}
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+    ~Connection() { close(fd); }
+
+    int fd;
+    // The start of a request whose newline has not arrived
+    std::string pending;
+    // Complete requests, to be answered by the next task
+    std::vector<std::string> requests;
+    // Dropping the rest of a request that was too long
+    bool skipping = false;
+    bool closed = false;
+  };
+
+  // Answers clients on the workers of `pool` until `stop` is called. Waiting
+  // clients are polled here, and whatever complete requests one has sent are
+  // answered by a single task, so idle clients do not hold a worker and each
+  // client's responses stay in order.
+  void acceptLoop(ThreadPool &pool) {
+    std::vector<std::shared_ptr<Connection>> waiting;
+    std::vector<pollfd> polled;
+    char chunk[1 << 16];
+    while (!stopping) {
+      polled.clear();
+      polled.push_back({listener, POLLIN, 0});
+      polled.push_back({wake[0], POLLIN, 0});
+      for (auto &conn : waiting)
+        polled.push_back({conn->fd, POLLIN, 0});
+      if (poll(polled.data(), polled.size(), -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+
+      std::vector<std::shared_ptr<Connection>> still;
+      for (size_t i = 0; i < waiting.size(); i++) {
+        std::shared_ptr<Connection> &conn = waiting[i];
+        if (polled[i + 2].revents) {
+          ssize_t n = read(conn->fd, chunk, sizeof(chunk));
+          if (n < 0 && errno == EINTR) {
+            still.push_back(std::move(conn));
+            continue;
+          }
+          if (n > 0)
+            receive(*conn, std::string_view(chunk, n));
+          else
+            finish(*conn);
+        }
+        if (conn->requests.empty() && !conn->closed) {
+          still.push_back(std::move(conn));
+        } else {
+          pool.submit([this, conn](unsigned) { serveRequests(conn); });
+        }
+      }
+      waiting = std::move(still);
+
+      if (polled[1].revents) {
+        while (read(wake[0], chunk, sizeof(chunk)) > 0) {
+        }
+        std::lock_guard<std::mutex> lock(answeredMutex);
+        for (auto &conn : answered)
+          waiting.push_back(std::move(conn));
+        answered.clear();
+      }
+
+      if (polled[0].revents) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client >= 0)
+          waiting.push_back(std::make_shared<Connection>(client));
+        else if (errno != EINTR && errno != ECONNABORTED)
+          break;
+      }
+    }
+    close(listener);
+    listener = -1;
+  }
+
+  // Makes `acceptLoop` return. Clients being answered are closed once their
+  // requests are.
+  void stop() {
+    stopping = true;
+    if (wake[1] >= 0)
+      std::ignore = write(wake[1], "", 1);
+  }
+
+  // Splits what `conn` has sent into requests
+  void receive(Connection &conn, std::string_view data) {
+    if (conn.skipping) {
+      size_t end = data.find('\n');
+      if (end == std::string_view::npos)
+        return;
+      conn.skipping = false;
+      data.remove_prefix(end + 1);
+    }
+    size_t end;
+    while ((end = data.find('\n')) != std::string_view::npos) {
+      conn.pending.append(data.substr(0, end));
+      conn.requests.push_back(std::move(conn.pending));
+      conn.pending.clear();
+      data.remove_prefix(end + 1);
+    }
+    conn.pending.append(data);
+    // Kept only so far as to be answered as too long
+    if (conn.pending.size() > maxRequestBytes) {
+      conn.pending.resize(maxRequestBytes + 1);
+      conn.requests.push_back(std::move(conn.pending));
+      conn.pending.clear();
+      conn.skipping = true;
+    }
+  }
+
+  // The client has closed its end; a last request need not end in a newline
+  void finish(Connection &conn) {
+    if (!conn.skipping && !conn.pending.empty())
+      conn.requests.push_back(std::move(conn.pending));
+    conn.pending.clear();
+    conn.closed = true;
+  }
+
+  // Runs on a worker. Answers the requests in one write, then hands the
+  // connection back to `acceptLoop` unless it is done with.
+  void serveRequests(std::shared_ptr<Connection> conn) {
+    std::string response;
+    for (auto &request : conn->requests)
+      answer(request, response);
+    conn->requests.clear();
+    if (!sendAll(conn->fd, response) || conn->closed)
+      return;
+    {
+      std::lock_guard<std::mutex> lock(answeredMutex);
+      answered.push_back(std::move(conn));
+    }
+    std::ignore = write(wake[1], "", 1);
+  }
+
+  // Returns false if the client has gone away
+  static bool sendAll(int fd, std::string_view data) {
+#ifdef MSG_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+    while (!data.empty()) {
+      ssize_t n = send(fd, data.data(), data.size(), flags);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return false;
+      data.remove_prefix(n);
+    }
+    return true;
+  }
+
+  int listener = -1;
+  // Written to wake `acceptLoop` from `stop` and from workers
+  int wake[2] = {-1, -1};
+  std::atomic<bool> stopping{false};
+  // Connections whose requests have been answered, for `acceptLoop` to poll
+  std::vector<std::shared_ptr<Connection>> answered;
+  std::mutex answeredMutex;
+#endif
+
+  // Not moved once added, as requests hold on to them
+  std::deque<std::pair<std::string, SharedRoot>> documents;
+  std::unordered_map<std::string, CompiledExpr> cache;
+  std::mutex cacheMutex;
+  size_t maxCached = 4096;
+  size_t maxRequestBytes = 1 << 20;
+};
@@ -0,0 +1,277 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) ||            \
+    defined(_M_IX86)
+#define JSON_EVAL_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// Functions using instructions beyond the compiler's baseline are marked so
+// that they can be built without global -m flags and picked at runtime.
+#if defined(JSON_EVAL_X86) && (defined(__GNUC__) || defined(__clang__))
+#define JSON_EVAL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define JSON_EVAL_TARGET(isa)
+#endif
+
+// Classification of 64 bytes of input, one bit per byte with the lowest bit
+// for the first byte
+struct BlockMasks {
+  uint64_t quote;
+  uint64_t backslash;
+  // [ ] { } : ,
+  uint64_t structural;
+  // space, \t, \n, \r
+  uint64_t whitespace;
+};
+
+using ClassifyFn = BlockMasks (*)(const char *block);
+
+inline BlockMasks classifyScalar(const char *block) {
+  BlockMasks masks{};
+  for (int i = 0; i < 64; i++) {
+    uint64_t bit = uint64_t(1) << i;
+    switch (block[i]) {
+    case '"':
+      masks.quote |= bit;
+      break;
+    case '\\':
+      masks.backslash |= bit;
+      break;
+    case '[':
+    case ']':
+    case '{':
+    case '}':
+    case ':':
+    case ',':
+      masks.structural |= bit;
+      break;
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+      masks.whitespace |= bit;
+      break;
+    }
+  }
+  return masks;
+}
+
+#ifdef JSON_EVAL_X86
+// Brackets are matched by setting bit 5, which maps [ and ] onto { and }
+JSON_EVAL_TARGET("sse2")
+inline BlockMasks classifySse2(const char *block) {
+  BlockMasks masks{};
+  for (int i = 0; i < 4; i++) {
+    __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16 * i));
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i quote = _mm_cmpeq_epi8(v, _mm_set1_epi8('"'));
+    __m128i backslash = _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'));
+    __m128i structural =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')),
+                                  _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+    __m128i whitespace =
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                                  _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+    int shift = 16 * i;
+    masks.quote |= uint64_t(uint16_t(_mm_movemask_epi8(quote))) << shift;
+    masks.backslash |= uint64_t(uint16_t(_mm_movemask_epi8(backslash)))
+                       << shift;
+    masks.structural |= uint64_t(uint16_t(_mm_movemask_epi8(structural)))
+                        << shift;
+    masks.whitespace |= uint64_t(uint16_t(_mm_movemask_epi8(whitespace)))
+                        << shift;
+  }
+  return masks;
+}
+
+JSON_EVAL_TARGET("avx2")
+inline BlockMasks classifyAvx2(const char *block) {
+  BlockMasks masks{};
+  for (int i = 0; i < 2; i++) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + 32 * i));
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i quote = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'));
+    __m256i backslash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'));
+    __m256i structural = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')),
+                        _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+    __m256i whitespace = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+    int shift = 32 * i;
+    masks.quote |= uint64_t(uint32_t(_mm256_movemask_epi8(quote))) << shift;
+    masks.backslash |= uint64_t(uint32_t(_mm256_movemask_epi8(backslash)))
+                       << shift;
+    masks.structural |= uint64_t(uint32_t(_mm256_movemask_epi8(structural)))
+                        << shift;
+    masks.whitespace |= uint64_t(uint32_t(_mm256_movemask_epi8(whitespace)))
+                        << shift;
+  }
+  return masks;
+}
+
+inline bool cpuHasAvx2() {
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+  // The OS must also save the AVX registers on context switches
+  __cpuid(info, 1);
+  if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+inline ClassifyFn selectClassify() {
+#ifdef JSON_EVAL_X86
+  if (cpuHasAvx2())
+    return classifyAvx2;
+  return classifySse2;
+#else
+  return classifyScalar;
+#endif
+}
+
+// The best implementation for this CPU, chosen once at startup
+inline const ClassifyFn classifyBlock = selectClassify();
+
+inline int lowestBit(uint64_t mask) { return std::countr_zero(mask); }
+
+// Min or max of a packed numeric array, which must not be empty
+using ReduceIntFn = int64_t (*)(const int64_t *vals, size_t n, bool isMin);
+using ReduceDoubleFn = double (*)(const double *vals, size_t n, bool isMin);
+
+inline int64_t reduceIntScalar(const int64_t *vals, size_t n, bool isMin) {
+  int64_t best = vals[0];
+  for (size_t i = 1; i < n; i++)
+    best = isMin ? std::min(best, vals[i]) : std::max(best, vals[i]);
+  return best;
+}
+
+inline double reduceDoubleScalar(const double *vals, size_t n, bool isMin) {
+  double best = vals[0];
+  for (size_t i = 1; i < n; i++)
+    best = isMin ? std::min(best, vals[i]) : std::max(best, vals[i]);
+  return best;
+}
+
+#ifdef JSON_EVAL_X86
+// The vector kernels keep the earlier value on ties within a lane (`min_pd`
+// returns its second operand on ties), but lanes hold interleaved elements.
+// So of 0.0 and -0.0, which compare equal, the first in the array is found
+// again here, as the scalar loop and `std::min` keep it.
+inline double firstOfEqual(const double *vals, size_t n, double best) {
+  return best == 0 ? *std::find(vals, vals + n, best) : best;
+}
+
+// SSE2 has no 64-bit integer compare, so only doubles have an SSE2 kernel
+JSON_EVAL_TARGET("sse2")
+inline double reduceDoubleSse2(const double *vals, size_t n, bool isMin) {
+  if (n < 2)
+    return vals[0];
+  __m128d best = _mm_loadu_pd(vals);
+  size_t i = 2;
+  for (; i + 2 <= n; i += 2) {
+    __m128d v = _mm_loadu_pd(vals + i);
+    best = isMin ? _mm_min_pd(v, best) : _mm_max_pd(v, best);
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, best);
+  double result = isMin ? std::min(lanes[0], lanes[1])
+                        : std::max(lanes[0], lanes[1]);
+  for (; i < n; i++)
+    result = isMin ? std::min(result, vals[i]) : std::max(result, vals[i]);
+  return firstOfEqual(vals, n, result);
+}
+
+JSON_EVAL_TARGET("avx2")
+inline int64_t reduceIntAvx2(const int64_t *vals, size_t n, bool isMin) {
+  if (n < 4)
+    return reduceIntScalar(vals, n, isMin);
+  __m256i best = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(vals));
+  size_t i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(vals + i));
+    // Lanes where `v` is better than the best so far
+    __m256i better = isMin ? _mm256_cmpgt_epi64(best, v)
+                           : _mm256_cmpgt_epi64(v, best);
+    best = _mm256_blendv_epi8(best, v, better);
+  }
+  int64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), best);
+  int64_t result = lanes[0];
+  for (int lane = 1; lane < 4; lane++)
+    result = isMin ? std::min(result, lanes[lane])
+                   : std::max(result, lanes[lane]);
+  for (; i < n; i++)
+    result = isMin ? std::min(result, vals[i]) : std::max(result, vals[i]);
+  return result;
+}
+
+JSON_EVAL_TARGET("avx2")
+inline double reduceDoubleAvx2(const double *vals, size_t n, bool isMin) {
+  if (n < 4)
+    return reduceDoubleScalar(vals, n, isMin);
+  __m256d best = _mm256_loadu_pd(vals);
+  size_t i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256d v = _mm256_loadu_pd(vals + i);
+    best = isMin ? _mm256_min_pd(v, best) : _mm256_max_pd(v, best);
+  }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, best);
+  double result = lanes[0];
+  for (int lane = 1; lane < 4; lane++)
+    result = isMin ? std::min(result, lanes[lane])
+                   : std::max(result, lanes[lane]);
+  for (; i < n; i++)
+    result = isMin ? std::min(result, vals[i]) : std::max(result, vals[i]);
+  return firstOfEqual(vals, n, result);
+}
+#endif
+
+inline ReduceIntFn selectReduceInt() {
+#ifdef JSON_EVAL_X86
+  if (cpuHasAvx2())
+    return reduceIntAvx2;
+#endif
+  return reduceIntScalar;
+}
+
+inline ReduceDoubleFn selectReduceDouble() {
+#ifdef JSON_EVAL_X86
+  if (cpuHasAvx2())
+    return reduceDoubleAvx2;
+  return reduceDoubleSse2;
+#else
+  return reduceDoubleScalar;
+#endif
+}
+
+inline const ReduceIntFn reduceInt = selectReduceInt();
+inline const ReduceDoubleFn reduceDouble = selectReduceDouble();
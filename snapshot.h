@@ -0,0 +1,465 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "document.h"
+#include "expr.h"
+#include "inputFile.h"
+#include "jsonWriter.h"
+
+// A parsed document saved in a binary form that is queried where it lies, so
+// loading it is only a memory mapping.
+//
+// Layout, in native byte order:
+//   SnapshotHeader, whose `root` is the top-level value
+//   ARRAY:  `len` SnapshotNodes
+//   OBJECT: `len` SnapshotMembers in document order, then `len` uint32_t
+//           member positions sorted by key, for binary search
+//   STRING: `len` bytes, not terminated. Each distinct key is stored once.
+// Containers and strings refer to their contents by offset from the start of
+// the snapshot. Nodes and members are 8-byte aligned.
+
+struct SnapshotError : std::runtime_error {
+  inline SnapshotError(const std::string &key) : std::runtime_error(key) {}
+};
+
+struct SnapshotNode {
+  JsonNodeType type;
+  uint8_t reserved[3];
+  // STRING: bytes, ARRAY: elements, OBJECT: members
+  uint32_t len;
+  union {
+    uint64_t offset;
+    bool boolean;
+    int64_t integer;
+    double number;
+  };
+};
+static_assert(sizeof(SnapshotNode) == 16);
+
+struct SnapshotMember {
+  uint64_t keyOffset;
+  uint32_t keyLen;
+  uint32_t reserved;
+  SnapshotNode val;
+};
+static_assert(sizeof(SnapshotMember) == 32);
+
+struct SnapshotHeader {
+  inline static constexpr char expectedMagic[8] = {'J', 'S', 'O', 'N',
+                                                   'S', 'N', 'A', 'P'};
+  inline static constexpr uint32_t currentVersion = 1;
+  // Reads back differently on a machine of the other byte order
+  inline static constexpr uint32_t expectedByteOrder = 0x01020304;
+
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  // Of the whole snapshot, to detect truncated files
+  uint64_t size;
+  SnapshotNode root;
+};
+
+// A value of a snapshot, or one computed from it such as a size. Offsets are
+// checked as they are followed, so a damaged snapshot throws `SnapshotError`
+// instead of reading outside it.
+struct SnapshotValue {
+  inline static SnapshotValue fromNode(const JsonNode &literal) {
+    SnapshotValue val;
+    val.node.type = literal.type;
+    if (literal.type == JsonNodeType::INT)
+      val.node.integer = literal.integer;
+    else if (literal.type == JsonNodeType::NUMBER)
+      val.node.number = literal.number;
+    return val;
+  }
+
+  inline SnapshotValue child(const SnapshotNode &childNode) const {
+    SnapshotValue val = *this;
+    val.node = childNode;
+    return val;
+  }
+
+  template <class T>
+  inline const T *at(uint64_t offset, uint64_t count) const {
+    if (offset > bytes || count > (bytes - offset) / sizeof(T) ||
+        offset % alignof(T))
+      throw SnapshotError("Corrupt snapshot");
+    return reinterpret_cast<const T *>(base + offset);
+  }
+
+  inline std::string_view getString() const {
+    if (node.type != JsonNodeType::STRING)
+      throw InvalidOperation("Cannot treat " + typeName() + " as string");
+    return {at<char>(node.offset, node.len), node.len};
+  }
+  inline double getNumber() const {
+    if (node.type == JsonNodeType::INT)
+      return node.integer;
+    if (node.type != JsonNodeType::NUMBER)
+      throw InvalidOperation("Cannot treat " + typeName() + " as number");
+    return node.number;
+  }
+  inline int64_t getInt() const {
+    if (node.type != JsonNodeType::INT)
+      throw InvalidOperation("Cannot treat " + typeName() + " as int");
+    return node.integer;
+  }
+  inline SnapshotValue getIndex(int64_t index) const {
+    if (node.type == JsonNodeType::OBJECT)
+      throw InvalidOperation("Cannot index object by int");
+    if (node.type != JsonNodeType::ARRAY)
+      throw InvalidOperation("Cannot index " + typeName());
+    if (auto val = findIndex(index))
+      return *val;
+    throw InvalidOperation("Invalid index to array: " + std::to_string(index));
+  }
+  // As `getIndex` and `getKey`, but nullopt instead of throwing if there is
+  // no such element or member, or this is not an array or object
+  inline std::optional<SnapshotValue> findIndex(int64_t index) const {
+    if (node.type != JsonNodeType::ARRAY || index < 0 || index >= node.len)
+      return std::nullopt;
+    return child(at<SnapshotNode>(node.offset, node.len)[index]);
+  }
+  inline SnapshotValue getKey(std::string_view key) const {
+    if (node.type == JsonNodeType::ARRAY)
+      throw InvalidOperation("Cannot index array by key");
+    if (node.type != JsonNodeType::OBJECT)
+      throw InvalidOperation("Cannot index " + typeName());
+    if (auto val = findKey(key))
+      return *val;
+    throw InvalidOperation("Key not in object: " + std::string(key));
+  }
+  inline std::optional<SnapshotValue> findKey(std::string_view key) const {
+    if (node.type != JsonNodeType::OBJECT)
+      return std::nullopt;
+    const SnapshotMember *members = at<SnapshotMember>(node.offset, node.len);
+    const uint32_t *order = at<uint32_t>(
+        node.offset + node.len * sizeof(SnapshotMember), node.len);
+    // Past the last member with the key, as later duplicates win
+    size_t lo = 0, hi = node.len;
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (keyOf(members, order[mid]) <= key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo == 0 || keyOf(members, order[lo - 1]) != key)
+      return std::nullopt;
+    return child(members[order[lo - 1]].val);
+  }
+  inline std::string_view keyOf(const SnapshotMember *members,
+                                uint32_t index) const {
+    if (index >= node.len)
+      throw SnapshotError("Corrupt snapshot");
+    const SnapshotMember &member = members[index];
+    return {at<char>(member.keyOffset, member.keyLen), member.keyLen};
+  }
+  inline int64_t size() const {
+    switch (node.type) {
+    case JsonNodeType::STRING:
+    case JsonNodeType::ARRAY:
+    case JsonNodeType::OBJECT:
+      return node.len;
+    default:
+      throw InvalidOperation("Cannot take size of " + typeName());
+    }
+  }
+  inline SnapshotValue minMax(bool isMin) const {
+    if (node.type != JsonNodeType::ARRAY)
+      throw InvalidOperation("Can only take min/max of array");
+    if (node.len == 0)
+      throw InvalidOperation(isMin ? "Min called on empty array"
+                                   : "Max called on empty array");
+    const SnapshotNode *elems = at<SnapshotNode>(node.offset, node.len);
+    size_t index = 0;
+    double best = child(elems[0]).getNumber();
+    for (size_t i = 1; i < node.len; i++) {
+      double v = child(elems[i]).getNumber();
+      if (isMin ? v < best : v > best) {
+        best = v;
+        index = i;
+      }
+    }
+    return child(elems[index]);
+  }
+
+  inline std::string toString() const {
+    std::string out;
+    JsonWriter writer(out);
+    write(writer);
+    return out;
+  }
+
+  inline void write(JsonWriter &out) const {
+    switch (node.type) {
+    case JsonNodeType::NULL_:
+      out.null();
+      break;
+    case JsonNodeType::BOOL:
+      out.boolean(node.boolean);
+      break;
+    case JsonNodeType::INT:
+      out.integer(node.integer);
+      break;
+    case JsonNodeType::NUMBER:
+      out.number(node.number);
+      break;
+    case JsonNodeType::STRING:
+      out.string(getString());
+      break;
+    case JsonNodeType::ARRAY: {
+      const SnapshotNode *elems = at<SnapshotNode>(node.offset, node.len);
+      out.beginArray();
+      for (size_t i = 0; i < node.len; i++)
+        child(elems[i]).write(out);
+      out.endArray();
+      break;
+    }
+    case JsonNodeType::OBJECT: {
+      const SnapshotMember *members = at<SnapshotMember>(node.offset, node.len);
+      out.beginObject();
+      for (uint32_t i = 0; i < node.len; i++) {
+        out.key(keyOf(members, i));
+        child(members[i].val).write(out);
+      }
+      out.endObject();
+      break;
+    }
+    default:
+      throw SnapshotError("Corrupt snapshot");
+    }
+  }
+
+  inline std::string typeName() const {
+    switch (node.type) {
+    case JsonNodeType::NULL_:
+      return "null";
+    case JsonNodeType::BOOL:
+      return "bool";
+    case JsonNodeType::INT:
+      return "int";
+    case JsonNodeType::NUMBER:
+      return "number";
+    case JsonNodeType::STRING:
+      return "string";
+    case JsonNodeType::ARRAY:
+      return "array";
+    case JsonNodeType::OBJECT:
+      return "object";
+    }
+    throw SnapshotError("Corrupt snapshot");
+  }
+
+  // The snapshot this value belongs to
+  const char *base = nullptr;
+  size_t bytes = 0;
+  SnapshotNode node{};
+};
+
+template <> struct ExprValue<SnapshotValue> {
+  inline static SnapshotValue literal(const ExprNode &node) {
+    return SnapshotValue::fromNode(node.literalNode);
+  }
+  inline static SnapshotValue getKey(const SnapshotValue &val,
+                                     const ExprNode &node) {
+    return val.getKey(node.key);
+  }
+  inline static SnapshotValue getIndex(const SnapshotValue &val,
+                                       const SnapshotValue &index) {
+    return val.getIndex(index.getInt());
+  }
+  inline static SnapshotValue getIndexAt(const SnapshotValue &val,
+                                         int64_t index) {
+    return val.getIndex(index);
+  }
+  inline static std::optional<SnapshotValue> findKey(const SnapshotValue &val,
+                                                     const ExprNode &node) {
+    return val.findKey(node.key);
+  }
+  inline static std::optional<SnapshotValue>
+  findIndex(const SnapshotValue &val, const SnapshotValue &index) {
+    return val.findIndex(index.getInt());
+  }
+  inline static std::optional<SnapshotValue>
+  findIndexAt(const SnapshotValue &val, int64_t index) {
+    return val.findIndex(index);
+  }
+  inline static SnapshotValue null() { return SnapshotValue(); }
+  inline static bool isNull(const SnapshotValue &val) {
+    return val.node.type == JsonNodeType::NULL_;
+  }
+  inline static double getNumber(const SnapshotValue &val) {
+    return val.getNumber();
+  }
+  inline static SnapshotValue size(const SnapshotValue &val) {
+    return SnapshotValue::fromNode(JsonNode::makeInt(val.size()));
+  }
+  inline static SnapshotValue minMax(const SnapshotValue &val, bool isMin) {
+    return val.minMax(isMin);
+  }
+};
+
+// Lays a `Document` out as a snapshot in one pass. Each container's slots are
+// reserved before its children are placed, after it.
+struct SnapshotWriter {
+  std::string write(const JsonNode &root) {
+    out.assign(sizeof(SnapshotHeader), '\0');
+    keyOffsets.clear();
+    SnapshotHeader header{};
+    std::memcpy(header.magic, SnapshotHeader::expectedMagic,
+                sizeof(header.magic));
+    header.version = SnapshotHeader::currentVersion;
+    header.byteOrder = SnapshotHeader::expectedByteOrder;
+    header.root = place(root);
+    header.size = out.size();
+    std::memcpy(out.data(), &header, sizeof(header));
+    return std::move(out);
+  }
+
+  // Returns false if the file cannot be written
+  bool save(const JsonNode &root, const std::string &path) {
+    std::string data = write(root);
+    FILE *file = std::fopen(path.c_str(), "wb");
+    if (!file)
+      return false;
+    bool ok = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    return std::fclose(file) == 0 && ok;
+  }
+
+  SnapshotNode place(const JsonNode &node) {
+    SnapshotNode snap{};
+    snap.type = node.type;
+    switch (node.type) {
+    case JsonNodeType::NULL_:
+      break;
+    case JsonNodeType::BOOL:
+      snap.boolean = node.boolean;
+      break;
+    case JsonNodeType::INT:
+      snap.integer = node.integer;
+      break;
+    case JsonNodeType::NUMBER:
+      snap.number = node.number;
+      break;
+    case JsonNodeType::STRING:
+      snap.len = node.len;
+      snap.offset = out.size();
+      out.append(node.str, node.len);
+      break;
+    case JsonNodeType::ARRAY:
+      snap.len = node.len;
+      snap.offset = reserve(node.len * sizeof(SnapshotNode));
+      for (size_t i = 0; i < node.len; i++) {
+        SnapshotNode elem = place(node.elems[i]);
+        std::memcpy(out.data() + snap.offset + i * sizeof(elem), &elem,
+                    sizeof(elem));
+      }
+      break;
+    case JsonNodeType::OBJECT: {
+      snap.len = node.len;
+      snap.offset = reserve(node.len * sizeof(SnapshotMember) +
+                            node.len * sizeof(uint32_t));
+      // Stable, so duplicates stay in document order
+      std::vector<uint32_t> order(node.len);
+      std::iota(order.begin(), order.end(), 0);
+      std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return node.members[a].key < node.members[b].key;
+      });
+      std::memcpy(out.data() + snap.offset + node.len * sizeof(SnapshotMember),
+                  order.data(), order.size() * sizeof(uint32_t));
+      for (size_t i = 0; i < node.len; i++) {
+        SnapshotMember member{};
+        std::string_view key = node.members[i].key;
+        member.keyOffset = placeKey(key);
+        member.keyLen = key.size();
+        member.val = place(node.members[i].val);
+        std::memcpy(out.data() + snap.offset + i * sizeof(member), &member,
+                    sizeof(member));
+      }
+      break;
+    }
+    }
+    return snap;
+  }
+
+  uint64_t placeKey(std::string_view key) {
+    auto [it, added] = keyOffsets.try_emplace(key, out.size());
+    if (added)
+      out.append(key);
+    return it->second;
+  }
+
+  // Zeroed, and aligned for nodes
+  uint64_t reserve(size_t size) {
+    out.resize((out.size() + 7) & ~size_t(7));
+    uint64_t offset = out.size();
+    out.resize(offset + size);
+    return offset;
+  }
+
+  std::string out;
+  // Keys point into the document being written
+  std::unordered_map<std::string_view, uint64_t> keyOffsets;
+};
+
+// A snapshot file, memory-mapped where possible. Only the header is checked
+// on opening; everything else is read on demand.
+struct Snapshot {
+  // Returns false if the file cannot be read, and throws `SnapshotError` if it
+  // is not a snapshot
+  bool open(const std::string &path) {
+    if (!file.open(path))
+      return false;
+    rootOf(file.data());
+    return true;
+  }
+
+  // The results refer into the snapshot, so they are only valid while it is
+  // open
+  SnapshotValue root() const { return rootOf(file.data()); }
+
+  SnapshotValue eval(const CompiledExpr &expr) const {
+    return expr.evalRoot(root());
+  }
+
+  std::vector<BatchResult<SnapshotValue>> eval(const ExprBatch &batch) const {
+    return batch.evalAll(root());
+  }
+
+  static SnapshotValue rootOf(std::string_view data) {
+    SnapshotHeader header;
+    if (data.size() < sizeof(header))
+      throw SnapshotError("Not a snapshot");
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.magic, SnapshotHeader::expectedMagic,
+                    sizeof(header.magic)) != 0)
+      throw SnapshotError("Not a snapshot");
+    if (header.byteOrder != SnapshotHeader::expectedByteOrder)
+      throw SnapshotError("Snapshot was saved with the other byte order");
+    if (header.version != SnapshotHeader::currentVersion)
+      throw SnapshotError("Unsupported snapshot version: " +
+                          std::to_string(header.version));
+    if (header.size != data.size())
+      throw SnapshotError("Snapshot is truncated");
+    if (reinterpret_cast<uintptr_t>(data.data()) % alignof(SnapshotNode))
+      throw SnapshotError("Snapshot is not aligned in memory");
+    SnapshotValue val;
+    val.base = data.data();
+    val.bytes = data.size();
+    val.node = header.root;
+    return val;
+  }
+
+  InputFile file;
+};
@@ -0,0 +1,247 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <ostream>
+#include <string>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "jsonTokeniser.h"
+#include "jsonWriter.h"
+
+// Where the time of a run goes, and how much it parsed and allocated. Counted
+// only when built with JSON_EVAL_STATS (the CMake option of the same name);
+// otherwise every hook below is empty and compiles away.
+//
+// Parsers count into their own `ParseCounts` and add them to the process-wide
+// totals once per document, so counting costs one increment per token.
+// Nothing is added to the totals until `statsActive` is set, so threads do
+// not contend on them in runs that do not report.
+
+enum class StatsPhase { READ, PARSE, COMPILE, EVALUATE, WRITE };
+
+inline constexpr const char *statsPhaseNames[] = {"read", "parse", "compile",
+                                                  "evaluate", "write"};
+// Values are counted by kind in this order
+inline constexpr const char *statsValueNames[] = {
+    "null", "bool", "int", "number", "string", "array", "object"};
+
+// A copy of the totals, from `collectStats`
+struct Stats {
+  struct Phase {
+    double wallMs = 0;
+    double cpuMs = 0;
+  };
+  Phase phases[5];
+  uint64_t tokens = 0;
+  uint64_t values[7] = {};
+  // Only counted by programs that route `operator new` to `countAllocation`,
+  // as json_eval does
+  uint64_t allocations = 0;
+  uint64_t allocatedBytes = 0;
+  uint64_t peakRssKb = 0;
+
+  void writeText(std::ostream &out) const {
+    for (int i = 0; i < 5; i++) {
+      out << statsPhaseNames[i] << ": " << phases[i].wallMs << " ms wall, "
+          << phases[i].cpuMs << " ms cpu\n";
+    }
+    out << "tokens: " << tokens << "\nvalues:";
+    for (int i = 0; i < 7; i++)
+      out << ' ' << statsValueNames[i] << ' ' << values[i];
+    out << "\nallocations: " << allocations << " (" << allocatedBytes
+        << " bytes)\npeak rss: " << peakRssKb << " KB\n";
+  }
+
+  void write(JsonWriter &out) const {
+    out.beginObject();
+    out.key("phases");
+    out.beginObject();
+    for (int i = 0; i < 5; i++) {
+      out.key(statsPhaseNames[i]);
+      out.beginObject();
+      out.key("wall_ms");
+      out.number(phases[i].wallMs);
+      out.key("cpu_ms");
+      out.number(phases[i].cpuMs);
+      out.endObject();
+    }
+    out.endObject();
+    out.key("tokens");
+    out.integer(tokens);
+    out.key("values");
+    out.beginObject();
+    for (int i = 0; i < 7; i++) {
+      out.key(statsValueNames[i]);
+      out.integer(values[i]);
+    }
+    out.endObject();
+    out.key("allocations");
+    out.integer(allocations);
+    out.key("allocated_bytes");
+    out.integer(allocatedBytes);
+    out.key("peak_rss_kb");
+    out.integer(peakRssKb);
+    out.endObject();
+  }
+};
+
+// The process-wide totals
+struct StatsTotals {
+  std::atomic<uint64_t> wallNs[5] = {};
+  std::atomic<uint64_t> cpuNs[5] = {};
+  std::atomic<uint64_t> tokens{0};
+  std::atomic<uint64_t> values[7] = {};
+  std::atomic<uint64_t> allocations{0};
+  std::atomic<uint64_t> allocatedBytes{0};
+};
+
+inline StatsTotals &statsTotals() {
+  static StatsTotals totals;
+  return totals;
+}
+
+inline void resetStats() {
+  StatsTotals &totals = statsTotals();
+  for (int i = 0; i < 5; i++) {
+    totals.wallNs[i] = 0;
+    totals.cpuNs[i] = 0;
+  }
+  totals.tokens = 0;
+  for (auto &count : totals.values)
+    count = 0;
+  totals.allocations = 0;
+  totals.allocatedBytes = 0;
+}
+
+inline Stats collectStats() {
+  Stats stats;
+  StatsTotals &totals = statsTotals();
+  for (int i = 0; i < 5; i++) {
+    stats.phases[i].wallMs = totals.wallNs[i] / 1e6;
+    stats.phases[i].cpuMs = totals.cpuNs[i] / 1e6;
+  }
+  stats.tokens = totals.tokens;
+  for (int i = 0; i < 7; i++)
+    stats.values[i] = totals.values[i];
+  stats.allocations = totals.allocations;
+  stats.allocatedBytes = totals.allocatedBytes;
+#ifndef _WIN32
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    stats.peakRssKb = usage.ru_maxrss;
+#endif
+  return stats;
+}
+
+inline std::atomic<bool> statsActive{false};
+
+#ifdef JSON_EVAL_STATS
+inline constexpr bool statsEnabled = true;
+
+inline void countAllocation(size_t bytes) {
+  if (!statsActive.load(std::memory_order_relaxed))
+    return;
+  StatsTotals &totals = statsTotals();
+  totals.allocations.fetch_add(1, std::memory_order_relaxed);
+  totals.allocatedBytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+// Adds the wall and CPU time between construction and destruction to a phase.
+// CPU time is of the whole process, so it includes any worker threads.
+struct StatsTimer {
+  explicit StatsTimer(StatsPhase phase)
+      : phase(static_cast<int>(phase)),
+        wallStart(std::chrono::steady_clock::now()), cpuStart(std::clock()) {}
+  StatsTimer(const StatsTimer &) = delete;
+  StatsTimer &operator=(const StatsTimer &) = delete;
+
+  ~StatsTimer() {
+    if (!statsActive.load(std::memory_order_relaxed))
+      return;
+    auto wall = std::chrono::steady_clock::now() - wallStart;
+    double cpuNs = double(std::clock() - cpuStart) * 1e9 / CLOCKS_PER_SEC;
+    StatsTotals &totals = statsTotals();
+    totals.wallNs[phase] +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(wall).count();
+    totals.cpuNs[phase] += cpuNs;
+  }
+
+  int phase;
+  std::chrono::steady_clock::time_point wallStart;
+  std::clock_t cpuStart;
+};
+
+struct ParseCounts {
+  void token() { tokens++; }
+
+  void value(JsonTokenType type) {
+    switch (type) {
+    case JsonTokenType::NULL_:
+      values[0]++;
+      break;
+    case JsonTokenType::TRUE:
+    case JsonTokenType::FALSE:
+      values[1]++;
+      break;
+    case JsonTokenType::INT:
+      values[2]++;
+      break;
+    case JsonTokenType::NUMBER:
+      values[3]++;
+      break;
+    case JsonTokenType::STRING:
+      values[4]++;
+      break;
+    case JsonTokenType::LEFT_SQUARE:
+      values[5]++;
+      break;
+    case JsonTokenType::LEFT_CURLY:
+      values[6]++;
+      break;
+    default:
+      break;
+    }
+  }
+
+  // Adds the counts to the totals and starts again
+  void flush() {
+    if (!statsActive.load(std::memory_order_relaxed)) {
+      *this = ParseCounts();
+      return;
+    }
+    StatsTotals &totals = statsTotals();
+    totals.tokens.fetch_add(tokens, std::memory_order_relaxed);
+    for (int i = 0; i < 7; i++)
+      totals.values[i].fetch_add(values[i], std::memory_order_relaxed);
+    *this = ParseCounts();
+  }
+
+  uint64_t tokens = 0;
+  uint64_t values[7] = {};
+};
+#else
+inline constexpr bool statsEnabled = false;
+
+inline void countAllocation(size_t) {}
+
+struct StatsTimer {
+  explicit StatsTimer(StatsPhase) {}
+};
+
+struct ParseCounts {
+  void token() {}
+  void value(JsonTokenType) {}
+  void flush() {}
+};
+#endif
+
+// Returns what `fn` returns, timed as `phase`
+inline auto timePhase(StatsPhase phase, auto &&fn) {
+  StatsTimer timer(phase);
+  return fn();
+}
@@ -1,6 +1,18 @@
 #include <gtest/gtest.h>
 
+#include <fstream>
+#include <sstream>
+#include <thread>
+
 #include "eval.h"
+#include "inputFile.h"
+#include "jsonPath.h"
+#include "lines.h"
+#include "parallelParser.h"
+#include "patch.h"
+#include "server.h"
+#include "snapshot.h"
+#include "stats.h"
 
 std::string testJson =
     R"delim^^(
@@ -102,3 +114,1144 @@ TEST(JSONEvalTest, InvalidOperation2) {
 TEST(JSONEvalTest, InvalidOperation3) {
   EXPECT_THROW(evaluate(testJson, "a.b[x]"), InvalidOperation);
 }
+
+TEST(CompiledExprTest, ReusedAcrossDocuments) {
+  CompiledExpr expr = compileExpr("max(a.b[0], a.b[1])");
+  JsonParser parser;
+  EXPECT_STREQ(expr.eval(parser.parse(testJson))->toString().c_str(), "2");
+  EXPECT_STREQ(expr.eval(parser.parse("{\"a\": {\"b\": [7, 3]}}"))
+                   ->toString()
+                   .c_str(),
+               "7");
+}
+
+TEST(CompiledExprTest, ParseErrorBeforeEval) {
+  EXPECT_THROW(compileExpr("a.b["), ExprParseError);
+  EXPECT_THROW(compileExpr("a..b"), ExprParseError);
+}
+
+TEST(CompiledExprTest, KeywordPrefixedIdentifiers) {
+  std::string result =
+      evaluate("{\"msg\": {\"sizes\": [4, 5]}}", "size(msg.sizes)")->toString();
+  EXPECT_STREQ(result.c_str(), "2");
+}
+
+TEST(DocumentTest, MatchesTree) {
+  DocumentParser parser;
+  Document doc = parser.parse(testJson);
+  for (auto expr : {"a.b[1]", "a.b[2].c", "a.b[a.b[1]].c", "min(a.b[3])",
+                    "max(a.b[0], 10, a.b[1], 15)", "size(a.b)", "a"}) {
+    EXPECT_EQ(compileExpr(expr).eval(doc).toString(),
+              evaluate(testJson, expr)->toString());
+  }
+}
+
+TEST(DocumentTest, EmptyContainers) {
+  DocumentParser parser;
+  Document doc = parser.parse("{\"a\": [], \"b\": {}}");
+  EXPECT_STREQ(doc.root.toString().c_str(), "{\"a\": [], \"b\": {}}");
+  EXPECT_STREQ(compileExpr("size(b)").eval(doc).toString().c_str(), "0");
+}
+
+TEST(DocumentTest, Errors) {
+  DocumentParser parser;
+  EXPECT_THROW(parser.parse("{abc}"), JsonParseError);
+  EXPECT_THROW(parser.parse("[1 2]"), JsonParseError);
+  Document doc = parser.parse(testJson);
+  EXPECT_THROW(compileExpr("a.b[4]").eval(doc), InvalidOperation);
+  EXPECT_THROW(compileExpr("min(a)").eval(doc), InvalidOperation);
+
+  // Lengths past 32 bits are refused rather than cut short; nothing is read
+  // through the pointers
+  const char text[] = "x";
+  size_t tooLong = size_t(UINT32_MAX) + 1;
+  EXPECT_THROW(JsonNode::makeString(std::string_view(text, tooLong)),
+               JsonParseError);
+  EXPECT_THROW(JsonNode::makeArray(nullptr, tooLong), JsonParseError);
+  EXPECT_THROW(JsonNode::makeObject(nullptr, tooLong), JsonParseError);
+  EXPECT_EQ(JsonNode::makeArray(nullptr, UINT32_MAX).len, UINT32_MAX);
+}
+
+TEST(JSONEvalTest, StringEscapes) {
+  JsonParser parser;
+  Json json = parser.parse(R"({"a\"b": "x\\y\né😀"})");
+  EXPECT_STREQ(json->toString().c_str(), R"({"a\"b": "x\\y\né😀"})");
+  EXPECT_EQ(json->getKey("a\"b")->size(), 10);
+  EXPECT_THROW(parser.parse(R"("\q")"), JsonParseError);
+}
+
+TEST(DocumentTest, ZeroCopyStrings) {
+  DocumentParser parser;
+  Document doc = parser.parse(R"({"plain": "abc", "escaped": "a\tb"})");
+  std::string_view plain = doc.root.getKey("plain").getString();
+  EXPECT_GE(plain.data(), doc.buffer->data());
+  EXPECT_LT(plain.data(), doc.buffer->data() + doc.buffer->size());
+  EXPECT_EQ(doc.root.getKey("escaped").getString(), "a\tb");
+  EXPECT_STREQ(doc.root.toString().c_str(),
+               R"({"plain": "abc", "escaped": "a\tb"})");
+}
+
+TEST(JSONEvalTest, JSONParseFailures) {
+  for (auto input : {"", "[1, 2", "[1, 2,]", "[1 2]", "{\"a\" 1}", "{\"a\": 1,}",
+                     "{\"a\": 1 \"b\": 2}", "[1]]", "\"abc", "tru", "[1, @]"}) {
+    JsonParser parser;
+    EXPECT_THROW(parser.parse(input), JsonParseError) << input;
+    DocumentParser docParser;
+    EXPECT_THROW(docParser.parseView(input), JsonParseError) << input;
+  }
+}
+
+TEST(JSONEvalTest, OptionalChaining) {
+  EXPECT_EQ(evaluate(testJson, "a?.x")->toString(), "null");
+  EXPECT_EQ(evaluate(testJson, "a.b[2]?.c")->toString(), "\"test\"");
+  EXPECT_EQ(evaluate(testJson, "a.b?.[7]")->toString(), "null");
+  EXPECT_EQ(evaluate(testJson, "a.b[0]?.x")->toString(), "null");
+  EXPECT_EQ(evaluate(testJson, "a?.x?.y")->toString(), "null");
+  // Each `?.` only covers its own step
+  EXPECT_THROW(evaluate(testJson, "a?.x.y"), InvalidOperation);
+  EXPECT_THROW(evaluate(testJson, "a.b?.[a.x]"), InvalidOperation);
+  EXPECT_THROW(evaluate(testJson, "a?."), ExprParseError);
+  EXPECT_THROW(evaluate(testJson, "a?.1"), ExprParseError);
+  EXPECT_THROW(evaluate(testJson, "a?b"), ExprParseError);
+}
+
+TEST(JSONEvalTest, Coalesce) {
+  EXPECT_EQ(evaluate(testJson, "a.x ?? 0")->toString(), "0");
+  EXPECT_EQ(evaluate(testJson, "a.b[0] ?? 5")->toString(), "1");
+  EXPECT_EQ(evaluate(testJson, "a.x.y[2] ?? a.b[3]")->toString(), "[11, 12]");
+  EXPECT_EQ(evaluate(testJson, "a.x ?? a.y ?? 2.5")->toString(), "2.5");
+  EXPECT_EQ(evaluate(testJson, "a?.x ?? 1")->toString(), "1");
+  EXPECT_EQ(evaluate("{\"a\": null}", "a ?? 1")->toString(), "1");
+  EXPECT_EQ(evaluate(testJson, "a.b[a.x ?? 1]")->toString(), "2");
+  EXPECT_EQ(evaluate(testJson, "max(a.x ?? 3, a.b[0])")->toString(), "3");
+  EXPECT_EQ(evaluate(testJson, "size(a.b[7]) ?? -1")->toString(), "-1");
+  // Only missing members and elements fall back
+  EXPECT_THROW(evaluate(testJson, "max(a.b[2], 1) ?? 0"), InvalidOperation);
+  EXPECT_THROW(evaluate(testJson, "a.x ?? a.y"), InvalidOperation);
+  EXPECT_THROW(evaluate(testJson, "?? 1"), ExprParseError);
+  EXPECT_THROW(evaluate(testJson, "a ??"), ExprParseError);
+
+  // The same without exceptions in between
+  Json doc = JsonParser().parse(testJson);
+  EXPECT_EQ(doc->getKey("a")->findKey("x", KeyCache()), nullptr);
+  EXPECT_NE(doc->getKey("a")->findKey("b", KeyCache()), nullptr);
+  EXPECT_EQ(doc->getKey("a")->getKey("b")->findIndex(4), nullptr);
+  EXPECT_EQ(doc->findIndex(0), nullptr);
+  Document document = DocumentParser().parseView(testJson);
+  EXPECT_EQ(document.root.findKey("x"), nullptr);
+  EXPECT_EQ(document.root.getKey("a").findKey("b")->findIndex(3)->size(), 2);
+}
+
+TEST(JSONEvalTest, NoTokenBuffer) {
+  JsonParser parser;
+  parser.parse(testJson);
+  EXPECT_TRUE(parser.tokeniser.tokens.empty());
+}
+
+TEST(SimdTest, KernelsAgree) {
+  std::string chars = "\"\\[]{}:, \t\n\rab01";
+  std::string block(64, ' ');
+  unsigned seed = 1;
+  std::vector<ClassifyFn> kernels = {classifyBlock};
+#ifdef JSON_EVAL_X86
+  kernels.push_back(classifySse2);
+  if (cpuHasAvx2())
+    kernels.push_back(classifyAvx2);
+#endif
+  for (int round = 0; round < 1000; round++) {
+    for (auto &c : block) {
+      seed = seed * 1103515245 + 12345;
+      c = chars[(seed >> 16) % chars.size()];
+    }
+    BlockMasks expected = classifyScalar(block.data());
+    for (ClassifyFn kernel : kernels) {
+      BlockMasks masks = kernel(block.data());
+      EXPECT_EQ(masks.quote, expected.quote);
+      EXPECT_EQ(masks.backslash, expected.backslash);
+      EXPECT_EQ(masks.structural, expected.structural);
+      EXPECT_EQ(masks.whitespace, expected.whitespace);
+    }
+  }
+}
+
+TEST(SimdTest, LongStringsAndWhitespace) {
+  std::string text(200, 'x');
+  for (size_t escape : {0, 62, 63, 64, 127, 198}) {
+    std::string raw = text;
+    raw.replace(escape, 2, "\\\"");
+    std::string json = "[" + std::string(100, ' ') + "\"" + raw + "\"" +
+                       std::string(70, '\n') + "]";
+    JsonParser parser;
+    Json result = parser.parse(json);
+    EXPECT_EQ(result->getIndex(0)->size(), 199);
+    EXPECT_EQ(result->size(), 1);
+  }
+  JsonParser parser;
+  EXPECT_THROW(parser.parse("\"" + text + "\\\""), JsonParseError);
+}
+
+TEST(LazyTest, MatchesFullParse) {
+  for (auto expr : {"a.b[1]", "a.b[2].c", "a.b[a.b[1]].c", "min(a.b[3])",
+                    "max(a.b[0], 10, a.b[1], 15)", "size(a.b)", "a",
+                    "size(a.b[a.b[1]].c)", "a.b[3][1]"}) {
+    EXPECT_EQ(evaluateLazy(testJson, expr)->toString(),
+              evaluate(testJson, expr)->toString());
+  }
+  EXPECT_THROW(evaluateLazy(testJson, "a.x"), InvalidOperation);
+  EXPECT_THROW(evaluateLazy(testJson, "a.b[4]"), InvalidOperation);
+}
+
+TEST(LazyTest, SkipsUnreadValues) {
+  std::string json = R"({"skip": {"s": "]}\"", "t": [[{}]]}, "keep": [1,
+    {"x": 1, "y": [2]}, {"x": 3}], "after": 4})";
+  JsonParser parser;
+  CompiledExpr expr = compileExpr("keep[keep[0]].y");
+  Json parsed = parser.parse(json, projectExpr(expr));
+  EXPECT_STREQ(parsed->toString().c_str(),
+               "{\"keep\": [1, {\"y\": [2]}, {}]}");
+  EXPECT_STREQ(expr.eval(parsed)->toString().c_str(), "[2]");
+  // Skipped values are not validated
+  EXPECT_STREQ(evaluateLazy("{\"a\": [1 2 3], \"b\": 5}", "b")->toString().c_str(),
+               "5");
+  EXPECT_THROW(evaluateLazy("{\"a\": [1, 2, \"b\": 5}", "b"), JsonParseError);
+}
+
+TEST(InputFileTest, MapsRegularFiles) {
+  std::string path = testing::TempDir() + "input_file_test.json";
+  {
+    std::ofstream out(path, std::ios::binary);
+    out << testJson;
+  }
+  InputFile file;
+  ASSERT_TRUE(file.open(path));
+#ifndef _WIN32
+  EXPECT_TRUE(file.isMapped());
+#endif
+  EXPECT_EQ(file.data(), testJson);
+  EXPECT_STREQ(evaluate(file.data(), "a.b[2].c")->toString().c_str(),
+               "\"test\"");
+
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  }
+  ASSERT_TRUE(file.open(path));
+  EXPECT_EQ(file.data(), "");
+  EXPECT_FALSE(file.open(path + ".missing"));
+}
+
+TEST(LinesTest, OutputInInputOrder) {
+  std::string input;
+  for (int i = 0; i < 1000; i++)
+    input += "{\"a\": {\"b\": [" + std::to_string(i) + "]}}\n";
+  input += "\n{\"a\": 1}\r\n{\"a\": {\"b\": [-1]}}";
+  CompiledExpr expr = compileExpr("a.b[0]");
+  ThreadPool pool(4);
+  LinesEvaluator evaluator(expr, pool);
+  evaluator.chunkBytes = 100;
+  std::stringstream out, err;
+  EXPECT_EQ(evaluator.run(input, out, err), 1);
+
+  std::string expected;
+  for (int i = 0; i < 1000; i++)
+    expected += std::to_string(i) + "\n";
+  expected += "-1\n";
+  EXPECT_EQ(out.str(), expected);
+  EXPECT_EQ(err.str(), "Line 1002: Invalid Operation: Cannot index int\n");
+}
+
+TEST(CompiledExprTest, SharesRepeatedSubexpressions) {
+  CompiledExpr expr =
+      compileExpr("max(a.b[a.b[1]].c, a.b[a.b[1]].c, size(a.b), a.b[3][0])");
+  const auto &args = expr.root->args;
+  EXPECT_EQ(args[0], args[1]);
+  EXPECT_EQ(args[0]->base->base, args[2]->args[0]);
+  EXPECT_EQ(args[0]->base->args[0]->base, args[2]->args[0]);
+  EXPECT_EQ(args[0]->text, ".a.b[.a.b[1]].c");
+  EXPECT_GE(args[0]->slot, 0);
+  EXPECT_GE(args[2]->args[0]->slot, 0);
+  EXPECT_EQ(expr.slots, 2);
+  EXPECT_THROW(expr.eval(JsonParser().parse(testJson)), InvalidOperation);
+
+  // Equal values of different types stay apart
+  CompiledExpr literals = compileExpr("max(1, 1.0, 1, [1])");
+  EXPECT_NE(literals.root->args[0], literals.root->args[1]);
+  EXPECT_EQ(literals.root->args[0], literals.root->args[2]);
+  EXPECT_EQ(literals.root->args[1]->text, "1.0");
+  EXPECT_EQ(literals.eval(JsonParser().parse("[7, 8]"))->toString(), "8");
+  // As do infinities of either sign, which are written alike as null
+  CompiledExpr infinities = compileExpr("min(1e999, -1e999, 0, 1e999)");
+  EXPECT_NE(infinities.root->args[0], infinities.root->args[1]);
+  EXPECT_EQ(infinities.root->args[0], infinities.root->args[3]);
+  EXPECT_EQ(infinities.root->args[1]->text, "-inf");
+  Json empty = JsonParser().parse("{}");
+  EXPECT_EQ(infinities.eval(empty)->toString(), "null");
+  EXPECT_EQ(compileExpr("max(-1e999, 1e999, 0)").eval(empty)->toString(),
+            "null");
+  EXPECT_EQ(compileExpr("min(-1e999, 1e999, 0)").eval(empty)->getNumber(),
+            -INFINITY);
+  CompiledExpr sizes = compileExpr("max(size(a.b), size(a.b), a.b[1])");
+  EXPECT_EQ(sizes.eval(JsonParser().parse(testJson))->toString(), "4");
+}
+
+TEST(CompiledExprTest, CachesAcrossEvaluations) {
+  Json doc = JsonParser().parse(testJson);
+  ExprCache cache;
+  EXPECT_EQ(compileExpr("a.b[2].c").eval(doc, cache)->toString(), "\"test\"");
+  EXPECT_NE(cache.find(*compileExpr("a.b").root), nullptr);
+  EXPECT_EQ(cache.find(*compileExpr("a.c").root), nullptr);
+
+  // Expressions compiled separately find each other's results
+  ExprCache planted;
+  planted.use(doc);
+  planted.insert(*compileExpr("a.b").root, JsonParser().parse("[5]"));
+  EXPECT_EQ(compileExpr("a.b[0]").eval(doc, planted)->toString(), "5");
+  ExprBatch batch = compileExprs({"size(a.b)", "a.x"});
+  auto results = batch.eval(doc, planted);
+  EXPECT_EQ(results[0].value->toString(), "1");
+  EXPECT_FALSE(results[1].error.empty());
+
+  // Another document starts over
+  Json other = JsonParser().parse(testJson);
+  EXPECT_EQ(compileExpr("a.b[0]").eval(other, planted)->toString(), "1");
+}
+
+TEST(PathIndexTest, BuiltUpFront) {
+  PathIndex index(JsonParser().parse(testJson));
+  index.build();
+  // `a.b[3]` is packed, so its elements are left out
+  EXPECT_EQ(index.size(), 7);
+  for (auto expr : {"a.b[2].c", "a.b[a.b[1]].c", "size(a.b)", "a.b[3][1]",
+                    "max(a.b[0], a.b[1])", "a"}) {
+    EXPECT_EQ(compileExpr(expr).eval(index)->toString(),
+              evaluate(testJson, expr)->toString())
+        << expr;
+  }
+  EXPECT_THROW(compileExpr("a.b[9]").eval(index), InvalidOperation);
+
+  // A literal path is one probe, not a walk
+  index.entries[".a.b[2].c"] = std::make_shared<JsonInt>(42);
+  EXPECT_EQ(compileExpr("a.b[2].c").eval(index)->toString(), "42");
+  auto results = compileExprs({"a.b[2].c", "a.x"}).eval(index);
+  EXPECT_EQ(results[0].value->toString(), "42");
+  EXPECT_FALSE(results[1].error.empty());
+}
+
+TEST(PathIndexTest, Bounded) {
+  Json doc = JsonParser().parse(testJson);
+  PathIndex shallow(doc);
+  shallow.maxDepth = 2;
+  shallow.build();
+  EXPECT_EQ(shallow.size(), 2);
+  EXPECT_EQ(compileExpr("a.b[2].c").eval(shallow)->toString(), "\"test\"");
+
+  PathIndex subtree(doc);
+  subtree.subtrees = {".a.b[2]"};
+  subtree.build();
+  EXPECT_EQ(subtree.size(), 2);
+  EXPECT_EQ(subtree.entries.count(".a.b[2].c"), 1);
+
+  PathIndex few(doc);
+  few.maxEntries = 3;
+  few.build();
+  EXPECT_EQ(few.size(), 3);
+
+  // Keys expressions cannot name are left out, so they are not confused
+  PathIndex dotted(JsonParser().parse(R"({"a.b": 1, "a": {"b": 2}})"));
+  dotted.build();
+  EXPECT_EQ(compileExpr("a.b").eval(dotted)->toString(), "2");
+}
+
+TEST(PathIndexTest, FilledLazily) {
+  PathIndex index(JsonParser().parse(testJson));
+  index.lazy = true;
+  EXPECT_EQ(compileExpr("a.b[2].c").eval(index)->toString(), "\"test\"");
+  EXPECT_EQ(index.size(), 4);
+  EXPECT_EQ(compileExpr("a.b[a.b[0]]").eval(index)->toString(), "2");
+  EXPECT_EQ(index.size(), 5);
+  EXPECT_THROW(compileExpr("a.x.y").eval(index), InvalidOperation);
+  EXPECT_EQ(index.size(), 5);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&index, t] {
+      for (int i = 0; i < 100; i++) {
+        std::string expr = "a.b[" + std::to_string((i + t) % 3) + "]";
+        compileExpr(expr).eval(index);
+      }
+    });
+  }
+  for (auto &thread : threads)
+    thread.join();
+  EXPECT_EQ(index.size(), 6);
+}
+
+TEST(BatchTest, MatchesSingleEvaluation) {
+  std::vector<std::string> exprs = {"a.b[0]", "a.b[1]", "size(a.b)",
+                                    "a.b[a.b[1]].c", "a.b[3][1]", "a.b[1]",
+                                    "max(a.b[0], a.b[1])", "a.x", "a.b[1]"};
+  auto results = evaluateAll(testJson, exprs);
+  auto lazyResults = evaluateAllLazy(testJson, exprs);
+  ASSERT_EQ(results.size(), exprs.size());
+  for (size_t i = 0; i < exprs.size(); i++) {
+    if (exprs[i] == "a.x") {
+      EXPECT_FALSE(results[i].error.empty());
+      EXPECT_FALSE(lazyResults[i].error.empty());
+      continue;
+    }
+    std::string expected = evaluate(testJson, exprs[i])->toString();
+    EXPECT_TRUE(results[i].error.empty());
+    EXPECT_EQ(results[i].value->toString(), expected);
+    EXPECT_EQ(lazyResults[i].value->toString(), expected);
+  }
+}
+
+TEST(BatchTest, ParseErrorsStayWithTheirExpression) {
+  // Including one that fails after sharing a prefix with the others
+  std::vector<std::string> exprs = {"a.b[0]", "a.(", "a.b[1", "a.b[1]", ""};
+  auto results = evaluateAll(testJson, exprs);
+  auto lazyResults = evaluateAllLazy(testJson, exprs);
+  ASSERT_EQ(results.size(), 5);
+  EXPECT_EQ(results[0].value->toString(), "1");
+  EXPECT_EQ(results[1].error, "Expr Parse Error: Expected identifier after dot");
+  EXPECT_EQ(results[2].error.rfind("Expr Parse Error: ", 0), 0);
+  EXPECT_EQ(results[3].value->toString(), "2");
+  EXPECT_EQ(results[4].error, "Expr Parse Error: Empty expression");
+  EXPECT_EQ(lazyResults[3].value->toString(), "2");
+  EXPECT_EQ(lazyResults[1].error, results[1].error);
+
+  Document doc = DocumentParser().parseView(testJson);
+  auto docResults = compileExprs(exprs).eval(doc);
+  EXPECT_EQ(docResults[3].value.toString(), "2");
+  EXPECT_EQ(docResults[4].error, results[4].error);
+}
+
+TEST(BatchTest, SharesPathPrefixes) {
+  ExprBatch batch = compileExprs({"a.b[0]", "a.b[1]", "size(a.b)", "a.b[0]"});
+  const ExprNode &first = *batch.exprs[0].root;
+  const ExprNode &second = *batch.exprs[1].root;
+  EXPECT_EQ(first.base, second.base);
+  EXPECT_EQ(first.base, batch.exprs[2].root->args[0]);
+  EXPECT_EQ(batch.exprs[0].root, batch.exprs[3].root);
+  EXPECT_GE(first.base->slot, 0);
+  EXPECT_EQ(first.base->base->slot, -1);
+  // Expressions compiled on their own share nothing
+  EXPECT_NE(compileExpr("a.b[0]").root->base, first.base);
+
+  DocumentParser parser;
+  Document doc = parser.parse(testJson);
+  auto results = batch.eval(doc);
+  EXPECT_EQ(results[0].value.toString(), "1");
+  EXPECT_EQ(results[1].value.toString(), "2");
+  EXPECT_EQ(results[2].value.toString(), "4");
+  EXPECT_EQ(results[3].value.toString(), "1");
+}
+
+TEST(WriterTest, ShortestNumbers) {
+  EXPECT_EQ(evaluate("[2.0]", "[0]")->toString(), "2.0");
+  EXPECT_EQ(evaluate("[0.1]", "[0]")->toString(), "0.1");
+  EXPECT_EQ(evaluate("[0.30000000000000004]", "[0]")->toString(),
+            "0.30000000000000004");
+  EXPECT_EQ(JsonNumber(1e300).toString(), "1e+300");
+  EXPECT_EQ(evaluate("[-7]", "[0]")->toString(), "-7");
+  for (auto number : {"3.141592653589793", "-2.5e-05", "123456.789"}) {
+    double val = std::stod(number);
+    std::string out = JsonNumber(val).toString();
+    EXPECT_EQ(std::stod(out), val);
+  }
+}
+
+TEST(WriterTest, Pretty) {
+  std::string out;
+  JsonWriter writer(out, true);
+  JsonParser parser;
+  parser.parse(R"({"a": [1, {"b": null}, [], {}]})")->write(writer);
+  EXPECT_EQ(out, "{\n  \"a\": [\n    1,\n    {\n      \"b\": null\n    },\n"
+                 "    [],\n    {}\n  ]\n}");
+}
+
+TEST(WriterTest, FileMatchesString) {
+  JsonParser parser;
+  Json json = parser.parse(testJson);
+  std::string expected = json->toString();
+  DocumentParser docParser;
+  EXPECT_EQ(docParser.parse(testJson).root.toString(), expected);
+
+  FILE *file = std::tmpfile();
+  ASSERT_NE(file, nullptr);
+  {
+    JsonWriter writer(file);
+    writer.flushBytes = 8;
+    json->write(writer);
+    writer.newline();
+    json->write(writer);
+  }
+  std::string written(2 * expected.size() + 1, '\0');
+  std::rewind(file);
+  EXPECT_EQ(std::fread(written.data(), 1, written.size() + 1, file),
+            written.size());
+  std::fclose(file);
+  EXPECT_EQ(written, expected + "\n" + expected);
+}
+
+TEST(NumberTest, SixtyFourBitIntegers) {
+  std::string json = R"({"id": 9007199254740993, "ts": -1700000000123,
+    "top": 9223372036854775807, "big": 18446744073709551616})";
+  EXPECT_EQ(evaluate(json, "id")->toString(), "9007199254740993");
+  EXPECT_EQ(evaluate(json, "ts")->toString(), "-1700000000123");
+  EXPECT_EQ(evaluate(json, "top")->toString(), "9223372036854775807");
+  // Too big for 64 bits, so read as a double
+  EXPECT_EQ(evaluate(json, "big")->toString(), "18446744073709551616.0");
+  DocumentParser parser;
+  Document doc = parser.parse(json);
+  EXPECT_EQ(compileExpr("id").eval(doc).getInt(), 9007199254740993);
+  EXPECT_EQ(compileExpr("big").eval(doc).type, JsonNodeType::NUMBER);
+  EXPECT_THROW(evaluate("[1, 2, 3]", "[4294967296]"), InvalidOperation);
+}
+
+TEST(NumberTest, Exponents) {
+  EXPECT_EQ(evaluate("[1e3]", "[0]")->toString(), "1000.0");
+  EXPECT_EQ(evaluate("[-2.5E-3]", "[0]")->toString(), "-0.0025");
+  EXPECT_EQ(evaluate("[1e+2, 1e999, 1e-999]", "[0]")->toString(), "100.0");
+  EXPECT_EQ(evaluate("[1e999]", "[0]")->toString(), "null");
+  EXPECT_EQ(evaluate("[1e-999]", "[0]")->toString(), "0.0");
+  EXPECT_EQ(evaluate("{\"a\": [5, 7]}", "max(a[0], 6e0)")->toString(), "6.0");
+  for (auto bad : {"-", "[1.]", "[1e]", "[1e+]", "[-a]", "[.5]"})
+    EXPECT_THROW(evaluate(bad, "[0]"), JsonParseError) << bad;
+  EXPECT_THROW(evaluate("[1]", "[1.]"), ExprParseError);
+  EXPECT_THROW(evaluate("[1]", "[-]"), ExprParseError);
+}
+
+TEST(ObjectTest, DocumentOrder) {
+  std::string json = R"({"z": 1, "a": 2, "m": {"y": 3, "b": 4}, "a": 5})";
+  JsonParser parser;
+  // A repeated key keeps its first position and its last value
+  EXPECT_EQ(parser.parse(json)->toString(),
+            "{\"z\": 1, \"a\": 5, \"m\": {\"y\": 3, \"b\": 4}}");
+  EXPECT_EQ(evaluate(json, "size(m)")->toString(), "2");
+}
+
+TEST(ObjectTest, IndexedLookup) {
+  std::string json = "{";
+  for (int i = 0; i < 100; i++)
+    json += (i ? ", \"k" : "\"k") + std::to_string(i) + "\": " +
+            std::to_string(i);
+  json += "}";
+  JsonParser parser;
+  Json obj = parser.parse(json);
+  auto &object = dynamic_cast<JsonObject &>(*obj);
+  EXPECT_FALSE(object.index.empty());
+  EXPECT_EQ(obj->size(), 100);
+  for (int i = 0; i < 100; i++)
+    EXPECT_EQ(obj->getKey("k" + std::to_string(i))->getInt(), i);
+  EXPECT_THROW(obj->getKey("k100"), InvalidOperation);
+  EXPECT_EQ(obj->toString(), json);
+}
+
+TEST(KeyTableTest, RecordsShareKeys) {
+  JsonParser parser;
+  Json json = parser.parse(
+      R"([{"id": 1, "msg": "a"}, {"msg": "b", "id": 2}, {"msg": "c"}])");
+  EXPECT_EQ(parser.keys->size(), 2);
+  auto &first = dynamic_cast<JsonObject &>(*json->getIndex(0));
+  auto &second = dynamic_cast<JsonObject &>(*json->getIndex(1));
+  EXPECT_EQ(first.keys, second.keys);
+  EXPECT_EQ(first.members[0].first, second.members[1].first);
+  EXPECT_EQ(json->getIndex(2)->getKey("msg")->toString(), "\"c\"");
+  EXPECT_EQ(json->toString(),
+            R"([{"id": 1, "msg": "a"}, {"msg": "b", "id": 2}, {"msg": "c"}])");
+
+  KeyTable table;
+  EXPECT_EQ(table.find("x"), KeyTable::missing);
+  for (int i = 0; i < 1000; i++)
+    EXPECT_EQ(table.intern("k" + std::to_string(i)), i);
+  for (int i = 0; i < 1000; i++)
+    EXPECT_EQ(table.find("k" + std::to_string(i)), i);
+  EXPECT_EQ(table.intern("k7"), 7);
+}
+
+TEST(KeyTableTest, CachedLookupAcrossTables) {
+  CompiledExpr expr = compileExpr("b");
+  JsonParser parser;
+  // The same key has a different ID in each table
+  EXPECT_EQ(expr.eval(parser.parse(R"({"a": 1, "b": 2})"))->toString(), "2");
+  EXPECT_EQ(expr.eval(parser.parse(R"({"b": 3, "a": 4})"))->toString(), "3");
+  EXPECT_THROW(expr.eval(parser.parse(R"({"a": 5})")), InvalidOperation);
+
+  parser.reuseKeys = true;
+  Json first = parser.parse(R"({"a": 1})");
+  EXPECT_THROW(expr.eval(first), InvalidOperation);
+  // Added to the same table after a lookup missed
+  Json second = parser.parse(R"({"a": 1, "b": 6})");
+  EXPECT_EQ(expr.eval(second)->toString(), "6");
+  EXPECT_EQ(dynamic_cast<JsonObject &>(*first).keys,
+            dynamic_cast<JsonObject &>(*second).keys);
+}
+
+TEST(PackedArrayTest, Detection) {
+  JsonParser parser;
+  Json ints = parser.parse("[3, -1, 4, 1, 5]");
+  ASSERT_NE(dynamic_cast<JsonIntArray *>(ints.get()), nullptr);
+  EXPECT_EQ(ints->toString(), "[3, -1, 4, 1, 5]");
+  EXPECT_EQ(ints->getIndex(1)->getInt(), -1);
+  EXPECT_EQ(ints->size(), 5);
+  EXPECT_EQ(ints->min()->toString(), "-1");
+  EXPECT_EQ(ints->max()->toString(), "5");
+  EXPECT_THROW(ints->getIndex(5), InvalidOperation);
+
+  Json doubles = parser.parse("[0.5, 2.5e1, -3.0]");
+  ASSERT_NE(dynamic_cast<JsonDoubleArray *>(doubles.get()), nullptr);
+  EXPECT_EQ(doubles->toString(), "[0.5, 25.0, -3.0]");
+  EXPECT_EQ(doubles->max()->toString(), "25.0");
+
+  // Anything else keeps boxed elements, in order
+  for (auto json : {"[1, 2.5, 3]", "[1, 2, \"x\", 4]", "[1, 99999999999999999999]",
+                    "[1, [2]]", "[1.5, null]"}) {
+    Json arr = parser.parse(json);
+    EXPECT_NE(dynamic_cast<JsonArray *>(arr.get()), nullptr) << json;
+  }
+  EXPECT_EQ(parser.parse("[1, 2, \"x\", 4]")->toString(), "[1, 2, \"x\", 4]");
+  EXPECT_EQ(evaluate("[1, 2.5, 3]", "max([0], [1], [2])")->toString(), "3");
+  EXPECT_THROW(parser.parse("[1, 2,]"), JsonParseError);
+  EXPECT_THROW(parser.parse("[1, 2 3]"), JsonParseError);
+}
+
+TEST(PackedArrayTest, ReductionKernelsAgree) {
+  std::vector<ReduceIntFn> intKernels = {reduceInt};
+  std::vector<ReduceDoubleFn> doubleKernels = {reduceDouble};
+#ifdef JSON_EVAL_X86
+  doubleKernels.push_back(reduceDoubleSse2);
+  if (cpuHasAvx2()) {
+    intKernels.push_back(reduceIntAvx2);
+    doubleKernels.push_back(reduceDoubleAvx2);
+  }
+#endif
+  unsigned seed = 7;
+  for (size_t n = 1; n < 40; n++) {
+    std::vector<int64_t> ints(n);
+    std::vector<double> doubles(n);
+    for (size_t i = 0; i < n; i++) {
+      seed = seed * 1103515245 + 12345;
+      ints[i] = (int64_t(seed) << 20) - (int64_t(1) << 40);
+      doubles[i] = ints[i] / 3.0;
+    }
+    for (bool isMin : {true, false}) {
+      for (ReduceIntFn kernel : intKernels)
+        EXPECT_EQ(kernel(ints.data(), n, isMin),
+                  reduceIntScalar(ints.data(), n, isMin));
+      for (ReduceDoubleFn kernel : doubleKernels)
+        EXPECT_EQ(kernel(doubles.data(), n, isMin),
+                  reduceDoubleScalar(doubles.data(), n, isMin));
+    }
+  }
+
+  // Of 0.0 and -0.0 the first is kept, as for boxed arrays, wherever they fall
+  // in the lanes
+  for (std::vector<double> doubles :
+       {std::vector<double>{0.0, 1.0, 2.0, 3.0, -0.0, 5.0, 6.0, 7.0},
+        {1.0, -0.0, 0.0, 5.0}, {-0.0, 3.0, 0.0, 4.0, 1.0}, {5.0, 0.0, 1.0, -0.0},
+        {-1.0, -0.0, -2.0, 0.0, -3.0, 0.0, -4.0, -0.0, -5.0}}) {
+    for (bool isMin : {true, false}) {
+      double expected =
+          reduceDoubleScalar(doubles.data(), doubles.size(), isMin);
+      for (ReduceDoubleFn kernel : doubleKernels) {
+        double result = kernel(doubles.data(), doubles.size(), isMin);
+        EXPECT_EQ(result, expected);
+        EXPECT_EQ(std::signbit(result), std::signbit(expected));
+      }
+    }
+  }
+  std::string json = R"({"p": [0.0, 1.0, 2.0, 3.0, -0.0, 5.0, 6.0, 7.0],
+                          "q": [0.0, 1, 2, 3, -0.0, 5, 6, 7]})";
+  EXPECT_EQ(evaluate(json, "min(p)")->toString(),
+            evaluate(json, "min(q)")->toString());
+}
+
+TEST(QueryServerTest, Answers) {
+  QueryServer server;
+  JsonParser parser;
+  server.addDocument("main", parser.parse(testJson));
+  server.addDocument("other", parser.parse(R"({"x": [5, 6]})"));
+  std::istringstream in("a.b[1]\n@other max(x)\r\n@missing a\na.x\n"
+                        "a.b[\n@other\na.b[2]");
+  std::ostringstream out;
+  server.serveStream(in, out);
+  EXPECT_EQ(out.str(), "2\n6\nError: Unknown document: missing\n"
+                       "Error: Invalid Operation: Key not in object: x\n"
+                       "Error: Expr Parse Error: Expected closing bracket for subscript\n"
+                       "Error: Expr Parse Error: Empty expression\n"
+                       "{\"c\": \"test\"}\n");
+  // Compiled once, then reused
+  EXPECT_EQ(server.compile("a.b[1]").root, server.compile("a.b[1]").root);
+}
+
+TEST(QueryServerTest, Patches) {
+  QueryServer server;
+  JsonParser parser;
+  server.addDocument("main", parser.parse(testJson));
+  Json before = server.findDocument("main")->load();
+  std::istringstream in(
+      "!{\"op\": \"add\"}\n"
+      "![{\"op\": \"replace\", \"path\": \"/a/b/0\", \"value\": 5}]\n"
+      "a.b[0]\n"
+      "![{\"op\": \"remove\", \"path\": \"/a/x\"}]\n"
+      "![{\"op\": \"add\", \"path\": \"/a/b/-\", \"value\": 6}]\n"
+      "size(a.b)\n");
+  std::ostringstream out;
+  server.serveStream(in, out);
+  EXPECT_EQ(out.str(), "Error: Json Patch Error: Patch must be an array of "
+                       "operations\n"
+                       "true\n5\nError: Json Patch Error: Key not in object: x\n"
+                       "true\n5\n");
+  // Held versions are unchanged
+  EXPECT_EQ(before->getKey("a")->getKey("b")->getIndex(0)->getInt(), 1);
+}
+
+#ifndef _WIN32
+TEST(QueryServerTest, SocketClients) {
+  QueryServer server;
+  JsonParser parser;
+  server.addDocument("main", parser.parse(testJson));
+  std::string path = testing::TempDir() + "json_eval_test.sock";
+  server.listen(path);
+  ThreadPool pool(2);
+  std::thread acceptor([&] { server.acceptLoop(pool); });
+
+  auto query = [&](const std::string &requests) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    path.copy(addr.sun_path, path.size());
+    EXPECT_EQ(connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)),
+              0);
+    QueryServer::sendAll(fd, requests);
+    shutdown(fd, SHUT_WR);
+    std::string response;
+    char chunk[256];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+      response.append(chunk, n);
+    close(fd);
+    return response;
+  };
+  std::string first, second;
+  std::thread client([&] { first = query("a.b[0]\nsize(a.b)\n"); });
+  second = query("a.b[3][1]\na.x");
+  client.join();
+  EXPECT_EQ(first, "1\n4\n");
+  EXPECT_EQ(second, "12\nError: Invalid Operation: Key not in object: x\n");
+
+  server.stop();
+  acceptor.join();
+  unlink(path.c_str());
+}
+
+TEST(QueryServerTest, IdleClientsHoldNoWorker) {
+  QueryServer server;
+  server.addDocument("main", JsonParser().parse(testJson));
+  server.maxRequestBytes = 64;
+  std::string path = testing::TempDir() + "json_eval_idle_test.sock";
+  server.listen(path);
+  ThreadPool pool(1);
+  std::thread acceptor([&] { server.acceptLoop(pool); });
+
+  auto connectClient = [&] {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    path.copy(addr.sun_path, path.size());
+    EXPECT_EQ(connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)),
+              0);
+    // Fails rather than hangs if a client is never answered
+    timeval timeout{5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+  };
+  auto ask = [&](int fd, const std::string &requests, size_t lines) {
+    QueryServer::sendAll(fd, requests);
+    std::string response;
+    char chunk[256];
+    ssize_t n;
+    auto answered = [&] {
+      return size_t(std::count(response.begin(), response.end(), '\n'));
+    };
+    while (answered() < lines && (n = read(fd, chunk, sizeof(chunk))) > 0)
+      response.append(chunk, n);
+    return response;
+  };
+  // More open clients than workers, each answered in turn
+  int first = connectClient(), second = connectClient();
+  EXPECT_EQ(ask(first, "a.b[0]\n", 1), "1\n");
+  EXPECT_EQ(ask(second, "a.b[1]\n", 1), "2\n");
+  EXPECT_EQ(ask(first, "size(a.b)\n", 1), "4\n");
+
+  // Sent in pieces, and past the limit, without ending the connection
+  EXPECT_EQ(ask(second, "a.b", 0), "");
+  // Answered as soon as it passes the limit, and the rest of it dropped
+  EXPECT_EQ(ask(second, "[3][0]\n" + std::string(100, ' '), 2),
+            "11\nError: Request too long\n");
+  EXPECT_EQ(ask(second, std::string(100, ' ') + "a.b[0]\na.b[1]\n", 1),
+            "2\n");
+  close(first);
+  close(second);
+
+  server.stop();
+  acceptor.join();
+  unlink(path.c_str());
+}
+#endif
+
+TEST(SnapshotTest, AnswersLikeTheDocument) {
+  DocumentParser parser;
+  Document doc = parser.parseView(testJson);
+  std::string path = testing::TempDir() + "snapshot_test.snap";
+  SnapshotWriter writer;
+  ASSERT_TRUE(writer.save(doc.root, path));
+
+  Snapshot snapshot;
+  ASSERT_TRUE(snapshot.open(path));
+  EXPECT_EQ(snapshot.root().toString(), doc.root.toString());
+  for (const char *expr :
+       {"a.b[2].c", "a.b[a.b[1]].c", "max(a.b[0], 10, a.b[1], 15)",
+        "size(a.b)", "min(a.b[3])", "a", "a.x ?? a.b[2]?.c", "a?.[0]",
+        "a.b[9] ?? 0"}) {
+    EXPECT_EQ(snapshot.eval(compileExpr(expr)).toString(),
+              compileExpr(expr).eval(doc).toString())
+        << expr;
+  }
+  EXPECT_THROW(snapshot.eval(compileExpr("a.x")), InvalidOperation);
+  EXPECT_THROW(snapshot.eval(compileExpr("a.b[9]")), InvalidOperation);
+
+  auto results = snapshot.eval(compileExprs({"a.b[0]", "a.x", "size(a.b)"}));
+  EXPECT_EQ(results[0].value.toString(), "1");
+  EXPECT_FALSE(results[1].error.empty());
+  EXPECT_EQ(results[2].value.toString(), "4");
+}
+
+TEST(SnapshotTest, KeysAreSearchedInSortedOrder) {
+  std::string json = R"({"zeta": 1, "alpha": [true, null, -2.5], )"
+                     R"("mid": {"k": "v\n"}, "alpha": "last", "": 0})";
+  DocumentParser parser;
+  Document doc = parser.parseView(json);
+  std::string data = SnapshotWriter().write(doc.root);
+  SnapshotValue root = Snapshot::rootOf(data);
+
+  // Written back in document order, duplicates and all
+  EXPECT_EQ(root.toString(), doc.root.toString());
+  EXPECT_EQ(root.getKey("zeta").getInt(), 1);
+  EXPECT_EQ(root.getKey("alpha").getString(), "last");
+  EXPECT_EQ(root.getKey("mid").getKey("k").getString(), "v\n");
+  EXPECT_EQ(root.getKey("").getInt(), 0);
+  EXPECT_THROW(root.getKey("beta"), InvalidOperation);
+  EXPECT_THROW(root.getIndex(0), InvalidOperation);
+}
+
+TEST(SnapshotTest, RejectsDamagedSnapshots) {
+  DocumentParser parser;
+  Document doc = parser.parseView(R"({"a": [1, 2, 3], "b": "text"})");
+  std::string data = SnapshotWriter().write(doc.root);
+
+  EXPECT_THROW(Snapshot::rootOf(testJson), SnapshotError);
+  EXPECT_THROW(Snapshot::rootOf(std::string_view(data).substr(0, 20)),
+               SnapshotError);
+  EXPECT_THROW(Snapshot::rootOf(data.substr(0, data.size() - 1)),
+               SnapshotError);
+
+  // An offset pointing past the end is caught when it is followed
+  SnapshotHeader header;
+  std::memcpy(&header, data.data(), sizeof(header));
+  header.root.offset = data.size();
+  std::memcpy(data.data(), &header, sizeof(header));
+  SnapshotValue root = Snapshot::rootOf(data);
+  EXPECT_EQ(root.size(), 2);
+  EXPECT_THROW(root.getKey("a"), SnapshotError);
+}
+
+TEST(ParallelParserTest, MatchesSerialParse) {
+  ThreadPool pool(4);
+  ParallelParser parser(pool);
+  // Small runs, so even these documents are split many ways
+  parser.runBytes = 64;
+  std::string records;
+  for (int i = 0; i < 200; i++)
+    records += std::string(i ? ", " : "[") + "{\"id\": " + std::to_string(i) +
+               ", \"tags\": [\"a]\", {\"b\": null}], \"v\": 1.5}";
+  records += "]";
+  std::string mixed = R"( {"before": [1, 2], "ints": [)";
+  for (int i = 0; i < 100; i++)
+    mixed += std::to_string(i * 1000) + ", ";
+  mixed += R"("last"], "small": [], "nested": {"x": [1]}, "s": "\u0041"} )";
+
+  for (const std::string &json : {records, mixed, testJson}) {
+    Json parsed = parser.parse(json);
+    EXPECT_EQ(parsed->toString(), JsonParser().parse(json)->toString());
+  }
+  Json root = parser.parse(records);
+  EXPECT_EQ(root->size(), 200);
+  EXPECT_EQ(root->getIndex(150)->getKey("tags")->getIndex(0)->toString(),
+            "\"a]\"");
+  EXPECT_EQ(parser.parse(mixed)->getKey("ints")->getIndex(100)->toString(),
+            "\"last\"");
+}
+
+TEST(ParallelParserTest, JoinsPackedRuns) {
+  ThreadPool pool(4);
+  ParallelParser parser(pool);
+  parser.runBytes = 64;
+  std::string ints = "{\"ts\": [", doubles = "[";
+  for (int i = 0; i < 500; i++) {
+    ints += std::string(i ? ", " : "") + std::to_string(i * 7 % 499);
+    doubles += std::string(i ? ", " : "") + std::to_string(i) + ".5";
+  }
+  ints += "]}";
+  doubles += "]";
+
+  Json ts = parser.parse(ints)->getKey("ts");
+  ASSERT_NE(dynamic_cast<JsonIntArray *>(ts.get()), nullptr);
+  EXPECT_EQ(ts->size(), 500);
+  EXPECT_EQ(ts->max()->getInt(), 498);
+  Json values = parser.parse(doubles);
+  ASSERT_NE(dynamic_cast<JsonDoubleArray *>(values.get()), nullptr);
+  EXPECT_EQ(values->toString(), JsonParser().parse(doubles)->toString());
+}
+
+TEST(ParallelParserTest, ReportsErrorsInAnyRun) {
+  ThreadPool pool(4);
+  ParallelParser parser(pool);
+  parser.runBytes = 16;
+  std::string json = "[";
+  for (int i = 0; i < 100; i++)
+    json += std::string(i ? ", " : "") + (i == 70 ? "{\"a\" 1}" : "[1, 2]");
+  EXPECT_THROW(parser.parse(json + "]"), JsonParseError);
+  EXPECT_THROW(parser.parse(json), JsonParseError);
+  EXPECT_THROW(parser.parse("[1, 2 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13]"),
+               JsonParseError);
+  EXPECT_THROW(parser.parse("[[1, 2], [3, 4], [5, 6], [7, 8], [9]] x"),
+               JsonParseError);
+}
+
+TEST(StatsTest, CountsParsedValues) {
+  if (!statsEnabled)
+    GTEST_SKIP() << "Built without JSON_EVAL_STATS";
+  statsActive = true;
+  resetStats();
+  JsonParser().parse(testJson);
+  DocumentParser().parseView(testJson);
+  timePhase(StatsPhase::EVALUATE, [] { return evaluate(testJson, "a.b[1]"); });
+  Stats stats = collectStats();
+  statsActive = false;
+
+  // Each document is counted once per parse
+  EXPECT_EQ(stats.values[2], 3 * 4);
+  EXPECT_EQ(stats.values[4], 3 * 1);
+  EXPECT_EQ(stats.values[5], 3 * 2);
+  EXPECT_EQ(stats.values[6], 3 * 3);
+  EXPECT_GT(stats.tokens, 3 * 10);
+  EXPECT_GT(stats.phases[int(StatsPhase::EVALUATE)].wallMs, 0);
+
+  std::string out;
+  JsonWriter writer(out);
+  stats.write(writer);
+  Json parsed = JsonParser().parse(out);
+  EXPECT_EQ(parsed->getKey("values")->getKey("object")->getInt(), 3 * 3);
+
+  // Nothing is added unless requested
+  resetStats();
+  JsonParser().parse(testJson);
+  EXPECT_EQ(collectStats().tokens, 0);
+}
+
+TEST(JsonPatchTest, AppliesOperations) {
+  Json doc = JsonParser().parse(testJson);
+  std::string before = doc->toString();
+  JsonPatch patch(JsonParser().parse(R"([
+    {"op": "test", "path": "/a/b/2/c", "value": "test"},
+    {"op": "add", "path": "/a/d", "value": {"e": [1]}},
+    {"op": "add", "path": "/a/b/1", "value": 1.5},
+    {"op": "remove", "path": "/a/b/0"},
+    {"op": "replace", "path": "/a/b/2/c", "value": null},
+    {"op": "copy", "from": "/a/b/3", "path": "/a/d/f"},
+    {"op": "move", "from": "/a/d/e", "path": "/g"},
+    {"op": "test", "path": "/a/d", "value": {"f": [11, 12.0]}}
+  ])"));
+  Json after = patch.apply(doc);
+  EXPECT_EQ(after->toString(),
+            "{\"a\": {\"b\": [1.5, 2, {\"c\": null}, [11, 12]], \"d\": "
+            "{\"f\": [11, 12]}}, \"g\": [1]}");
+  EXPECT_EQ(doc->toString(), before);
+  // Only the path to each change is copied
+  EXPECT_EQ(after->getKey("a")->getKey("b")->getIndex(3),
+            doc->getKey("a")->getKey("b")->getIndex(3));
+  EXPECT_EQ(evaluate(after->toString(), "a.d.f[1]")->getInt(), 12);
+  EXPECT_EQ(compileExpr("a.d.f[0]").eval(after)->getInt(), 11);
+  // Copies made by one operation are not shared by later ones
+  Json copied = JsonPatch(JsonParser().parse(R"([
+    {"op": "add", "path": "/a/d", "value": {"e": 1}},
+    {"op": "copy", "from": "/a/d", "path": "/a/f"},
+    {"op": "add", "path": "/a/d/g", "value": 2},
+    {"op": "add", "path": "/a/f/e", "value": 3}
+  ])")).apply(doc);
+  EXPECT_EQ(copied->getKey("a")->getKey("d")->toString(),
+            "{\"e\": 1, \"g\": 2}");
+  EXPECT_EQ(copied->getKey("a")->getKey("f")->toString(), "{\"e\": 3}");
+
+  EXPECT_EQ(JsonPatch::add(doc, "", JsonParser().parse("3"))->getInt(), 3);
+  EXPECT_EQ(JsonPatch::get(JsonParser().parse(R"({"a/b": {"~": 7}})"),
+                           "/a~1b/~0")
+                ->getInt(),
+            7);
+}
+
+TEST(JsonPatchTest, KeepsPackedArraysPacked) {
+  Json doc = JsonParser().parse(R"({"xs": [1, 2, 3], "ys": [0.5]})");
+  Json ints = JsonPatch::replace(doc, "/xs/1", std::make_shared<JsonInt>(9));
+  ASSERT_NE(dynamic_cast<JsonIntArray *>(ints->getKey("xs").get()), nullptr);
+  EXPECT_EQ(ints->getKey("xs")->max()->getInt(), 9);
+  Json boxed = JsonPatch::add(doc, "/xs/0", std::make_shared<JsonString>("a"));
+  EXPECT_EQ(boxed->getKey("xs")->toString(), "[\"a\", 1, 2, 3]");
+  Json empty = JsonPatch::remove(doc, "/ys/0");
+  EXPECT_EQ(empty->getKey("ys")->toString(), "[]");
+  EXPECT_EQ(doc->getKey("xs")->toString(), "[1, 2, 3]");
+}
+
+TEST(JsonPatchTest, RejectsInvalidPatches) {
+  Json doc = JsonParser().parse(testJson);
+  std::string before = doc->toString();
+  auto apply = [&](const std::string &patch) {
+    return JsonPatch(JsonParser().parse(patch)).apply(doc);
+  };
+  // The first operation applies, but the patch as a whole does not
+  EXPECT_THROW(apply(R"([{"op": "add", "path": "/z", "value": 1},
+                         {"op": "test", "path": "/z", "value": 2}])"),
+               JsonPatchError);
+  EXPECT_THROW(apply(R"([{"op": "remove", "path": "/a/b/4"}])"),
+               JsonPatchError);
+  EXPECT_THROW(apply(R"([{"op": "add", "path": "/a/b/01", "value": 1}])"),
+               JsonPatchError);
+  EXPECT_THROW(apply(R"([{"op": "replace", "path": "/a/x", "value": 1}])"),
+               JsonPatchError);
+  EXPECT_THROW(apply(R"([{"op": "move", "from": "/a", "path": "/a/y"}])"),
+               JsonPatchError);
+  EXPECT_THROW(apply(R"([{"op": "add", "path": "a", "value": 1}])"),
+               JsonPatchError);
+  EXPECT_THROW(apply(R"([{"op": "add", "path": "/a/~2", "value": 1}])"),
+               JsonPatchError);
+  EXPECT_THROW(apply(R"([{"op": "add", "path": "/a"}])"), JsonPatchError);
+  EXPECT_THROW(apply(R"([{"op": "frobnicate", "path": "/a"}])"),
+               JsonPatchError);
+  EXPECT_EQ(doc->toString(), before);
+}
+
+TEST(JsonPatchTest, ReadersKeepTheirVersion) {
+  SharedRoot shared(JsonParser().parse(R"({"n": 0})"));
+  JsonPatch increment;
+  std::vector<Json> seen;
+  for (int i = 1; i <= 3; i++) {
+    seen.push_back(shared.load());
+    increment.ops = {{PatchOp::REPLACE, "/n", "", std::make_shared<JsonInt>(i)}};
+    shared.update(increment);
+  }
+  for (int i = 0; i < 3; i++)
+    EXPECT_EQ(seen[i]->getKey("n")->getInt(), i);
+  EXPECT_EQ(shared.load()->getKey("n")->getInt(), 3);
+}
+
+TEST(JsonPatchTest, ReplacingAKeyLeavesTheSharedTable) {
+  // Eight keys fill the table to the point where adding one would grow it
+  Json before = JsonParser().parse(
+      R"({"a": 1, "b": 2, "c": 3, "d": 4, "e": 5, "f": 6, "g": 7, "h": 8})");
+  auto *old = dynamic_cast<JsonObject *>(before.get());
+  const KeyTable &keys = *old->keys;
+  std::vector<uint32_t> slots = keys.slots;
+  JsonPatch replace;
+  replace.ops = {{PatchOp::REPLACE, "/a", "", std::make_shared<JsonInt>(9)}};
+  Json after = replace.apply(before);
+  auto *changed = dynamic_cast<JsonObject *>(after.get());
+  EXPECT_EQ(&*changed->keys, &keys);
+  EXPECT_EQ(keys.slots, slots);
+  EXPECT_EQ(keys.size(), 8);
+  EXPECT_EQ(before->getKey("a")->getInt(), 1);
+  EXPECT_EQ(after->getKey("a")->getInt(), 9);
+
+  // Nor does interning a key it already has
+  KeyTable table;
+  for (const char *key : {"a", "b", "c", "d", "e", "f", "g", "h"})
+    table.intern(key);
+  std::vector<uint32_t> full = table.slots;
+  EXPECT_EQ(table.intern("h"), 7);
+  EXPECT_EQ(table.slots, full);
+}
+
+TEST(JsonPathTest, MatchesEvaluate) {
+  Json doc = JsonParser().parse(testJson);
+  EXPECT_EQ(jsonPath<"a.b[1]">(doc)->getInt(), 2);
+  EXPECT_EQ(jsonPath<"a.b[2].c">(doc)->toString(),
+            evaluate(testJson, "a.b[2].c")->toString());
+  EXPECT_EQ(jsonPath<" a . b [ 3 ][1]">(doc)->getInt(), 12);
+  EXPECT_EQ(jsonPath<"[1]">(JsonParser().parse("[5, [6]]"))->toString(), "[6]");
+  // Against another document with the same keys, once the IDs are cached
+  EXPECT_EQ(jsonPath<"a.b[1]">(JsonParser().parse(testJson))->getInt(), 2);
+
+  Document document = DocumentParser().parseView(testJson);
+  EXPECT_EQ(jsonPath<"a.b[2].c">(document).toString(), "\"test\"");
+
+  EXPECT_THROW(jsonPath<"a.x">(doc), InvalidOperation);
+  EXPECT_THROW(jsonPath<"a.b[4]">(doc), InvalidOperation);
+  EXPECT_THROW(jsonPath<"a.b[-1]">(doc), InvalidOperation);
+  EXPECT_THROW(jsonPath<"a.b.c">(document), InvalidOperation);
+}
+
+TEST(JsonPathTest, ParsedAtCompileTime) {
+  static_assert(parsePath("a.b[2].c") == 4);
+  static_assert(JsonPath<"a.b[2].c">::steps[1].hash == fnv1a("b"));
+  static_assert(JsonPath<"a.b[2].c">::steps[2].index == 2);
+  // What would not compile as `jsonPath<...>`
+  for (const char *path : {"", "a..b", "a.", "a.b[", "a.b[]", "a[x]",
+                           "max(a)", "a.size", "1", "a b", "a[1.5]", "a[-]"})
+    EXPECT_THROW(parsePath(path), ExprParseError) << path;
+}
+
+TEST(ExprProgramTest, MatchesTreeWalk) {
+  Json doc = JsonParser().parse(testJson);
+  Document document = DocumentParser().parseView(testJson);
+  std::string many = "max(";
+  for (int i = 0; i < 12; i++)
+    many += std::string(i ? ", " : "") + "a.b[" + std::to_string(i % 2) + "]";
+  many += ")";
+  for (std::string input :
+       {"a.b[1]", "a.b[2].c", "a.b[a.b[0]]", "[0]", "size(a.b[3])",
+        "max(a.b[3])", "min(a.b[1], 1.5, a.b[0])", "max(a.b[a.b[0]], a.b[0])",
+        "min(a.b[0], max(a.b[3]), size(a.b))", many.c_str(), "a.b[2.0]",
+        "min(a.b[2], a.x)", "min(a.x, a.b[2])", "a.b[9]", "a.b.c",
+        "a.x ?? a.b[0]", "a.b[a.x ?? 1] ?? 7", "max(a.b[0], a.x ?? 9)",
+        "a.b[2]?.c", "a?.x", "a.b?.[9]", "a.b?.[a.b[0]]", "a?.x?.y ?? 3",
+        "a.b[0] ?? a.x", "a.x ?? a.y", "a.b[2].c ?? 1",
+        "max(a.b[a.b[0]], a.b[a.b[0]] ?? 0)", "a.b[a.b[0]] ?? a.b[a.b[0]]",
+        "min(a.b[2], a.x) ?? 0", "a.b.x ?? 5", "a.b[a.b[2]] ?? 0"}) {
+    CompiledExpr expr = compileExpr(input);
+    ASSERT_FALSE(expr.program.code.empty());
+    auto outcome = [&](auto &&eval) {
+      try {
+        return eval();
+      } catch (InvalidOperation &x) {
+        return std::string("error: ") + x.what();
+      }
+    };
+    std::string tree = outcome([&] {
+      return CompiledExpr::evalNode(*expr.root, doc)->toString();
+    });
+    EXPECT_EQ(outcome([&] { return expr.eval(doc)->toString(); }), tree)
+        << input;
+    EXPECT_EQ(outcome([&] { return expr.eval(document).toString(); }),
+              outcome([&] {
+                return CompiledExpr::evalNode(*expr.root, document.root)
+                    .toString();
+              }))
+        << input;
+  }
+  // Shared subexpressions are lowered once and loaded after
+  CompiledExpr shared = compileExpr("max(a.b[a.b[0]], a.b[0])");
+  EXPECT_EQ(std::count_if(shared.program.code.begin(),
+                          shared.program.code.end(),
+                          [](auto &ins) { return ins.op == ExprOp::LOAD; }),
+            2);
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads. Tasks are told which worker runs them, so
+// callers can keep per-worker state (parsers, buffers) that is never shared.
+struct ThreadPool {
+  // 0 threads means one per hardware thread
+  explicit ThreadPool(unsigned threads = 0) {
+    if (threads == 0)
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threads; i++)
+      workers.emplace_back([this, i] { run(i); });
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Finishes all queued tasks before returning
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+
+  unsigned size() const { return workers.size(); }
+
+  // Exceptions thrown by the task are rethrown from the future
+  std::future<void> submit(std::function<void(unsigned worker)> task) {
+    auto packaged =
+        std::make_shared<std::packaged_task<void(unsigned)>>(std::move(task));
+    std::future<void> result = packaged->get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back([packaged](unsigned worker) { (*packaged)(worker); });
+    }
+    wakeup.notify_one();
+    return result;
+  }
+
+  void run(unsigned worker) {
+    while (true) {
+      std::function<void(unsigned)> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wakeup.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty())
+          return;
+        task = std::move(queue.front());
+        queue.pop_front();
+      }
+      task(worker);
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::deque<std::function<void(unsigned)>> queue;
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  bool stopping = false;
+};